@@ -1,13 +1,12 @@
 /*
  * CAN_IO.cpp
- * Implementation of CAN_IO class.
+ * Implementation of CAN_IO class (the non-template part, CAN_IO_Base).
  */
 
 #include "CAN_IO.h"
-#include <SPI.h>
 
-CAN_IO::CAN_IO(byte CS_pin, byte INT_p, int baud, byte freq) : INT_pin(INT_p), controller(CS_pin, INT_p), bus_speed(baud), bus_freq(freq),
-															   tec(0), rec(0), errors(0) {}
+CAN_IO_Base::CAN_IO_Base(Frame_Lane &rx, Frame_Deque &tx, MCP2515_Transport &transport, int baud, byte freq, byte INT_p) : INT_pin(INT_p), controller(transport), bus_speed(baud), bus_freq(freq),
+																			  tec(0), rec(0), errors(0), tx_reserved(0), fast_rx(false), mailbox(0), stats(0), scheduler(0), rxb0_lane(&rx), rxb1_lane(0), peek_lane(0), tx_queue(&tx) {}
 
 /*
  * Define global interrupt function
@@ -18,18 +17,15 @@ void CAN_ISR()
 	main_CAN->int_counter++;
 }
 // Make sure to initialize the mainCAN pointer to 0 here.
-CAN_IO *main_CAN = 0;
+CAN_IO_Base *main_CAN = 0;
 
 /*
  * Setup function for CAN_IO. Arguments are a FilterInfo struct and a pointer to a place to raise error flags.
  */
-void CAN_IO::Setup(byte interrupts)
+void CAN_IO_Base::Setup(byte interrupts)
 { // default interrupts are RX0IE | RX1IE | TX1IE | TX2IE | TX0IE.
 	// SPI setup
-	SPI.setClockDivider(10);
-	SPI.setDataMode(SPI_MODE0);
-	SPI.setBitOrder(MSBFIRST);
-	SPI.begin();
+	controller.Begin();
 
 	// reset tx tracker
 	tx_open = 0x07;
@@ -37,7 +33,8 @@ void CAN_IO::Setup(byte interrupts)
 	// Set as main can
 	main_CAN = this;
 
-	pinMode(INT_pin, INPUT_PULLUP);
+	if (INT_pin != MCP2515_NO_PIN)
+		pinMode(INT_pin, INPUT_PULLUP);
 
 	// Copy filters and interrupts to internal variables
 	this->my_interrupts = interrupts;
@@ -46,8 +43,14 @@ void CAN_IO::Setup(byte interrupts)
 	init_controller(); //private helper function
 }
 
-inline void CAN_IO::init_controller() //private helper function
+inline void CAN_IO_Base::init_controller() //private helper function
 {
+	// The reset clears the TX buffers, so nothing is preloaded any more, and every TXP is 0
+	this->tx_reserved = 0;
+	this->tx_loads = 0;
+	for (byte n = 0; n < 3; n++)
+		this->tx_prio[n] = this->tx_seq[n] = 0;
+
 	// Clear error counters
 	this->errors = 0;
 	this->tec = 0;
@@ -90,32 +93,54 @@ inline void CAN_IO::init_controller() //private helper function
 	}
 }
 
-bool CAN_IO::Sleep()
+bool CAN_IO_Base::Sleep()
 {
 	return controller.Mode(MODE_SLEEP);
 }
 
-bool CAN_IO::Wake()
+bool CAN_IO_Base::Wake()
 {
+	controller.BitModify(CANINTF, WAKIF, WAKIF); // Set the WAKEIF bit to request that the controller wake up.
+	// The device wakes up in listen-only mode once its start-up timer runs. Mode() polls CANSTAT until
+	// it is back in normal mode, instead of waiting a fixed time.
+	return controller.Mode(MODE_NORMAL);
+}
 
+void CAN_IO_Base::Wake(ModeCallback callback)
+{
 	controller.BitModify(CANINTF, WAKIF, WAKIF); // Set the WAKEIF bit to request that the controller wake up.
-	noInterrupts();
-	delayMicroseconds(5000); //Wait for it to run the start-up timer
-	interrupts();
-	return controller.Mode(MODE_NORMAL); // The device wakes up in listen-only mode. Put it back in normal (we may have to clear the TX registers)
+	controller.RequestMode(MODE_NORMAL, 10, callback); // Finished by Fetch()
 }
 
-void CAN_IO::ResetController()
+void CAN_IO_Base::ResetController()
 {
 	this->init_controller(); // Re-initialize the controller.
 }
 
-void CAN_IO::Fetch()
+void CAN_IO_Base::Fetch()
 {
+	// finish any mode change requested with MCP2515::RequestMode()
+	if (controller.ModePending())
+		controller.PollMode();
+
+	// TX buffers without a TXnIE interrupt are polled instead
+	if (poll_tx())
+		send_queued();
+
 	// read status of CANINTF register
-	if (!controller.Interrupt())
+	// With RXnBF pins the fast receive path can check the buffers without INT or SPI.
+	if (!controller.Interrupt() && !(fast_rx && controller.BufferPins() && controller.BufferFull()))
 		return; // Do nothing if there is not an interrupt
 
+	if (fast_rx)
+	{
+		fetch_rx();
+
+		// If only the RX interrupts are enabled there is nothing else to handle.
+		if (!(my_interrupts & ~(RX0IE | RX1IE)) || !controller.Interrupt())
+			return;
+	}
+
 	byte interrupt = controller.GetInterrupt(); // Otherwise get the interrupt from the controller and process it.
 	byte to_clear = 0;
 	//Serial.print("FETCH ");
@@ -137,24 +162,23 @@ void CAN_IO::Fetch()
 		// be read by periodically calling FetchErrors().
 
 		// Get Messages
+		// RXnIF is not added to to_clear: READ RX BUFFER clears it when CS goes high, and clearing
+		// it again here could throw away a frame that arrived after the read.
 		if (interrupt & (RX0IF | RX1IF))
 		{
+			unsigned long stamp = CAN_Micros(); // One timer read covers both buffers
+
 			if (interrupt & RX1IF)
 			{ // receive buffer 1 full
-				RXbuffer.enqueue(controller.ReadBuffer(RXB1));
-				to_clear |= RX1IF;
+				receive(RXB1, stamp);
 			}
 
 			if (interrupt & RX0IF)
 			{ // receive buffer 0 full
-				RXbuffer.enqueue(controller.ReadBuffer(RXB0));
-				to_clear |= RX0IF;
+				receive(RXB0, stamp);
 			}
 
-			if (RXbuffer.is_full())
-				errors |= CANERR_RXBUFFER_FULL;
-			else
-				errors &= ~CANERR_RXBUFFER_FULL;
+			check_rx_full();
 		}
 
 		// Handle any other interrupts that might be flagged.
@@ -162,6 +186,7 @@ void CAN_IO::Fetch()
 		{ // message error
 			this->errors |= CANERR_MESSAGE_ERROR;
 			to_clear |= MERRF;
+			RecoverTransmissions(); // In one-shot mode the frame is not retried by the controller
 		}
 		else
 			this->errors &= (~CANERR_MESSAGE_ERROR);
@@ -198,16 +223,117 @@ void CAN_IO::Fetch()
 	}
 
 	// clear interrupt
-	controller.ResetInterrupt(to_clear); // reset all interrupts
+	if (to_clear)
+		controller.ResetInterrupt(to_clear); // reset all interrupts
+
+	// Refill the TX buffers that just emptied. This comes after the flags are cleared, so the
+	// TXnIF of a frame loaded here is not thrown away.
+	if (interrupt & (TX0IF | TX1IF | TX2IF))
+		send_queued();
 }
 
-void CAN_IO::FetchErrors()
+inline void CAN_IO_Base::receive(byte buffer, unsigned long stamp)
 {
-	this->tec = controller.Read(TEC);
-	this->rec = controller.Read(REC);
+	Frame frame = controller.ReadBuffer(buffer);
+	frame.timestamp = stamp;
+
+	if (stats)
+		stats->record(frame);
+
+	// Registered IDs only keep their latest value; everything else is queued.
+	if (mailbox && mailbox->store(frame))
+		return;
+	if (buffer == RXB1 && rxb1_lane)
+		rxb1_lane->enqueue(frame);
+	else
+		rxb0_lane->enqueue(frame);
+}
 
-	byte eflg = controller.Read(EFLG);
+int CAN_IO_Base::ReadMany(Frame *out, int n, uint32_t *dropped)
+{
+	if (dropped)
+		*dropped = dropped_frames();
+
+	peek_lane = 0; // A pending Peek() is consumed too
+	int count = rxb0_lane->read_many(out, n);
+	if (rxb1_lane && count < n)
+		count += rxb1_lane->read_many(out + count, n - count);
+	return count;
+}
+
+int CAN_IO_Base::Drain(FrameCallback fn, void *context, int n, uint32_t *dropped)
+{
+	if (dropped)
+		*dropped = dropped_frames();
+
+	peek_lane = 0;
+	int count = rxb0_lane->drain(fn, context, n);
+	if (rxb1_lane && count < n)
+		count += rxb1_lane->drain(fn, context, n - count);
+	return count;
+}
+
+inline uint32_t CAN_IO_Base::dropped_frames()
+{
+	return rxb0_lane->dropped() + (rxb1_lane ? rxb1_lane->dropped() : 0);
+}
+
+inline void CAN_IO_Base::check_rx_full()
+{
+	if (rxb0_lane->is_full() || (rxb1_lane && rxb1_lane->is_full()))
+		errors |= CANERR_RXBUFFER_FULL;
+	else
+		errors &= ~CANERR_RXBUFFER_FULL;
+}
+
+inline void CAN_IO_Base::fetch_rx()
+{
+	byte full = controller.BufferFull(); // RXnBF pins if set up, otherwise RX STATUS
+
+	if (!full)
+		return;
+
+	unsigned long stamp = CAN_Micros(); // One timer read covers both buffers
+
+	// RXB0 holds the higher priority filters, so read it first.
+	if (full & RX0IF)
+		receive(RXB0, stamp);
+
+	if (full & RX1IF)
+		receive(RXB1, stamp);
+
+	check_rx_full();
+}
+
+void CAN_IO_Base::FetchErrors()
+{
+	byte counters[2]; // TEC, REC
+	controller.Read(TEC, counters, 2);
+	this->tec = counters[0];
+	this->rec = counters[1];
+
+	update_errors(controller.Read(EFLG));
+}
+
+void CAN_IO_Base::FetchHealth()
+{
+	// CANSTAT is mirrored at 0x1E, right after TEC and REC, so one burst gets all three.
+	// CANINTE, CANINTF and EFLG sit next to each other too.
+	byte counters[3]; // TEC, REC, CANSTAT
+	byte flags[3];	  // CANINTE, CANINTF, EFLG
+	controller.Read(TEC, counters, 3);
+	controller.Read(CANINTE, flags, 3);
+
+	this->tec = counters[0];
+	this->rec = counters[1];
+	this->canstat_register = counters[2];
+	this->last_interrupt = flags[1];
+
+	update_errors(flags[2]);
+}
 
+inline void CAN_IO_Base::update_errors(byte eflg)
+{
 	if (eflg & 0x01) // If EWARN flag is set
 	{
 		if (eflg & 0x20) // if busmode flag is set
@@ -235,16 +361,21 @@ void CAN_IO::FetchErrors()
 			controller.BitModify(EFLG, 0xC0, 0x00); // Clear RXnOVR bits
 	}
 	else
-		errors &= ~(CANERR_HIGH_ERROR_COUNT & CANERR_BUSOFF_MODE & CANERR_RX0FULL_OCCURED & CANERR_RX1FULL_OCCURED);
+		errors &= ~(CANERR_HIGH_ERROR_COUNT | CANERR_BUSOFF_MODE | CANERR_RX0FULL_OCCURED | CANERR_RX1FULL_OCCURED);
 }
 
-void CAN_IO::FetchStatus()
+void CAN_IO_Base::FetchStatus()
 {
 	this->canstat_register = controller.Read(CANSTAT);
 }
 
 
-bool CAN_IO::SendVerified(const Layout &layout, uint8_t buffer)
+bool CAN_IO_Base::SendVerified(const Layout &layout, uint8_t buffer)
+{
+	return SendVerified(layout.generate_frame(), buffer);
+}
+
+bool CAN_IO_Base::SendVerified(const Frame &frame, uint8_t buffer)
 {
 	// The TXBANY buffer can be specified to allow the program to choose which buffer to send from.
 	// The TXnIE interrupt flags should be enabled for this to work properly.
@@ -257,41 +388,53 @@ bool CAN_IO::SendVerified(const Layout &layout, uint8_t buffer)
 		return false;
 	} // Fail
 
-	if (!controller.LoadBuffer(buffer, layout.generate_frame(), true))
+	if (!controller.LoadBuffer(buffer, frame, true))
 	{
 		Serial.println(F("LOAD FAILED"));
 		return false;
 	}
 	else
+	{
+		set_priority(buffer, CAN_ArbitrationKey(frame));
 		controller.SendBuffer(buffer);
+	}
 
 	//set a flag in the tx_open bitfield that this buffer is closed.
 	//It will clear on the first interrupt received after the buffer finishes sending
 	//For best performance, enable all TXnIE flags.
 	tx_open &= ~buffer;
 	return true;
-} 
+}
+
+
+bool CAN_IO_Base::Send(const Layout &layout, uint8_t buffer)
+{
+	return Send(layout.generate_frame(), buffer);
+}
 
-bool CAN_IO::SendVerified(const Frame &frame, uint8_t buffer)
+bool CAN_IO_Base::Send(const Frame &frame, uint8_t buffer)
 {
 	// The TXBANY buffer can be specified to allow the program to choose which buffer to send from.
-	// The TXnIE interrupt flags should be enabled for this to work properly.
+	// The frame is queued in priority order, behind any waiting frames with the same ID,
+	// and the best frames go out at once if buffers are open. Otherwise Fetch() sends them on the next TXnIF.
 	if (buffer == TXBANY)
 	{
-		buffer = select_open_buffer();
-	}
-	if (buffer == 0x00)
-	{
-		return false;
-	} // Fail
+		noInterrupts();
+		bool queued = tx_queue->enqueue_head(frame);
+		interrupts();
 
-	if (!controller.LoadBuffer(buffer, frame, true))
-	{
-		Serial.println(F("LOAD FAILED"));
-		return false;
+		if (queued)
+			this->errors &= ~CANERR_TXBUFFER_FULL;
+		else
+			this->errors |= CANERR_TXBUFFER_FULL;
+
+		send_queued();
+		return queued;
 	}
-	else
-		controller.SendBuffer(buffer);
+
+	controller.LoadBuffer(buffer, frame);
+	set_priority(buffer, CAN_ArbitrationKey(frame));
+	controller.SendBuffer(buffer);
 
 	//set a flag in the tx_open bitfield that this buffer is closed.
 	//It will clear on the first interrupt received after the buffer finishes sending
@@ -300,55 +443,266 @@ bool CAN_IO::SendVerified(const Frame &frame, uint8_t buffer)
 	return true;
 }
 
-
-bool CAN_IO::Send(const Layout &layout, uint8_t buffer)
+bool CAN_IO_Base::SendImage(MCP2515_TXImage &image, uint8_t buffer)
 {
-	// The TXBANY buffer can be specified to allow the program to choose which buffer to send from.
-	// The TXnIE interrupt flags should be enabled for this to work properly.
+	// With TXBANY the image goes straight into an open buffer only if nothing is waiting in
+	// TXbuffer, so it can't overtake queued frames. Otherwise it waits there as a Frame.
 	if (buffer == TXBANY)
 	{
-		buffer = select_open_buffer();
+		noInterrupts();
+		buffer = tx_queue->is_empty() ? select_open_buffer() : 0x00;
+		tx_open &= ~buffer;
+		interrupts();
+
+		if (buffer == 0x00)
+		{
+			Frame frame;
+			MCP2515::DecodeFrame(image.header, frame);
+			return Send(frame, TXBANY);
+		}
 	}
-	if (buffer == 0x00)
+
+	controller.LoadImage(buffer, image);
+	set_priority(buffer, CAN_ArbitrationKey(image));
+	controller.SendBuffer(buffer);
+	tx_open &= ~buffer;
+	return true;
+}
+
+inline void CAN_IO_Base::send_queued()
+{
+	bool polled = false;
+	while (true)
 	{
+		// Claim a buffer and a frame together, so Fetch() running in an interrupt can't take
+		// the same buffer.
+		noInterrupts();
+		uint8_t buffer = tx_queue->is_empty() ? 0x00 : select_open_buffer();
+		if (buffer == 0x00)
+		{
+			interrupts();
+			if (polled || tx_queue->is_empty())
+				return;
+			polled = true;
+			if (!poll_tx()) // A polled buffer may have finished since the last Fetch()
+				return;
+			continue;
+		}
+		tx_open &= ~buffer;
+		Frame frame = tx_queue->dequeue_tail();
+		interrupts();
+
+		if (!controller.LoadBuffer(buffer, frame))
+		{ // Put it back in front and try again on the next TXnIF
+			noInterrupts();
+			tx_queue->enqueue_tail(frame);
+			tx_open |= buffer;
+			interrupts();
+			return;
+		}
+		set_priority(buffer, CAN_ArbitrationKey(frame));
+		controller.SendBuffer(buffer);
+	}
+}
+
+inline bool CAN_IO_Base::poll_tx()
+{
+	// Closed buffers whose TXnIE is off: nothing else will ever reopen them.
+	byte polled = ~tx_open & (TXB0 | TXB1 | TXB2);
+	if (my_interrupts & TX0IE)
+		polled &= ~TXB0;
+	if (my_interrupts & TX1IE)
+		polled &= ~TXB1;
+	if (my_interrupts & TX2IE)
+		polled &= ~TXB2;
+	if (!polled)
 		return false;
-	} // Fail
 
-	controller.LoadBuffer(buffer, layout.generate_frame());
-	controller.SendBuffer(buffer);
+	// A cleared TXREQ means the buffer is done. TXnIF is not needed for that; it is left set,
+	// which is harmless with TXnIE off.
+	byte status = controller.Status();
+	byte done = 0;
+	if (!(status & STAT_TX0REQ))
+		done |= TXB0;
+	if (!(status & STAT_TX1REQ))
+		done |= TXB1;
+	if (!(status & STAT_TX2REQ))
+		done |= TXB2;
+
+	done &= polled;
+	if (!done)
+		return false;
 
-	//set a flag in the tx_open bitfield that this buffer is closed.
-	//It will clear on the first interrupt received after the buffer finishes sending
-	//For best performance, enable all TXnIE flags.
-	tx_open &= ~buffer;
+	// READ STATUS does not say whether the frame went out. Buffers that were aborted or failed
+	// in one-shot mode put their frame back in TXbuffer before they are reopened.
+	// Preloaded buffers keep their frame and just reopen.
+	tx_open |= done & tx_reserved;
+	recover_buffers(done & ~tx_reserved);
 	return true;
-} 
+}
 
-bool CAN_IO::Send(const Frame &frame, uint8_t buffer)
+inline void CAN_IO_Base::set_priority(uint8_t buffer, uint32_t key)
 {
-	// The TXBANY buffer can be specified to allow the program to choose which buffer to send from.
-	// The TXnIE interrupt flags should be enabled for this to work properly.
-	if (buffer == TXBANY)
+	// The controller sends the pending buffer with the highest TXP first. Rank the pending
+	// buffers the way their frames would win arbitration (the one loaded first among equal
+	// IDs) and give them TXP 3, 2 and 1. TXP is changed with BIT MODIFY, so a buffer that
+	// finishes meanwhile is not requested again.
+	byte n = buffer >> 1; // 0, 1 or 2
+	tx_key[n] = key;
+	tx_seq[n] = ++tx_loads;
+
+	rank_buffers((~tx_open & 0x07) | buffer);
+}
+
+inline void CAN_IO_Base::rank_buffers(byte pending)
+{
+	for (byte b = 0; b < 3; b++)
 	{
-		buffer = select_open_buffer();
+		if (!(pending & (1 << b)))
+			continue;
+
+		byte prio = 3;
+		for (byte p = 0; p < 3; p++)
+		{
+			if (p == b || !(pending & (1 << p)))
+				continue;
+			if (tx_key[p] < tx_key[b] || (tx_key[p] == tx_key[b] && int8_t(tx_seq[p] - tx_seq[b]) < 0))
+				prio--; // p goes first
+		}
+
+		if (prio != tx_prio[b])
+		{
+			controller.BitModify(TXB0CTRL + 0x10 * b, TXP_MASK, prio);
+			tx_prio[b] = prio;
+		}
 	}
-	if (buffer == 0x00)
+}
+
+byte CAN_IO_Base::RecoverTransmissions()
+{
+	byte requeued = recover_buffers(~(tx_open | tx_reserved) & (TXB0 | TXB1 | TXB2)); // Not idle or held by Preload()
+	send_queued();
+	return requeued;
+}
+
+inline byte CAN_IO_Base::recover_buffers(byte buffers)
+{
+	Frame failed[3];
+	byte count = 0;
+	byte osm = 0xFF; // CANCTRL.OSM, read the first time it is needed
+
+	for (byte n = 0; n < 3; n++)
 	{
-		return false;
-	} // Fail
+		byte buffer = 1 << n; // TXB0, TXB1, TXB2
+		if (!(buffers & buffer))
+			continue;
+
+		byte ctrl = controller.Read(TXB0CTRL + 0x10 * n);
+		if (ctrl & TXREQ)
+			continue; // Still pending
+
+		// MLOA and TXERR stay set after the controller retries and sends the frame, so they
+		// only mean it was not sent in one-shot mode.
+		bool unsent = ctrl & ABTF;
+		if (!unsent && (ctrl & (MLOA | TXERR)))
+		{
+			if (osm == 0xFF)
+				osm = controller.Read(CANCTRL) & OSM;
+			unsent = osm;
+		}
 
-	controller.LoadBuffer(buffer, frame);
-	controller.SendBuffer(buffer);
+		if (unsent)
+		{
+			byte raw[13]; // TXBnSIDH..TXBnD7
+			controller.Read(TXB0SIDH + 0x10 * n, raw, 13);
+			MCP2515::DecodeFrame(raw, failed[count]);
+			// Keep them in bus priority order: the winner goes back in front last.
+			for (byte i = count; i > 0 && CAN_ArbitrationKey(failed[i]) > CAN_ArbitrationKey(failed[i - 1]); i--)
+			{
+				Frame t = failed[i];
+				failed[i] = failed[i - 1];
+				failed[i - 1] = t;
+			}
+			count++;
+		}
+		tx_open |= buffer; // Sent or stopped, it is free again
+	}
 
-	//set a flag in the tx_open bitfield that this buffer is closed.
-	//It will clear on the first interrupt received after the buffer finishes sending
-	//For best performance, enable all TXnIE flags.
-	tx_open &= ~buffer;
+	byte requeued = 0;
+	noInterrupts();
+	for (byte i = 0; i < count; i++)
+	{
+		if (tx_queue->enqueue_tail(failed[i]))
+			requeued++;
+		else
+			this->errors |= CANERR_TXBUFFER_FULL;
+	}
+	interrupts();
+	return requeued;
+}
+
+int CAN_IO_Base::Poll()
+{
+	if (!scheduler)
+		return 0;
+
+	unsigned long now = CAN_Micros();
+	int sent = 0;
+	Frame frame;
+	int handle;
+	while ((handle = scheduler->next(now, frame)) >= 0)
+	{
+		if (Send(frame, TXBANY))
+			sent++;
+		else
+			scheduler->failed(handle);
+	}
+	return sent;
+}
+
+bool CAN_IO_Base::Preload(const Frame &frame, uint8_t buffer)
+{
+	if (buffer != TXB0 && buffer != TXB1 && buffer != TXB2)
+		return false;
+	if (!(tx_open & buffer))
+		return false; // Still sending
+
+	// Held while loading, so an auto-fetch can't put a queued frame in it meanwhile
+	tx_reserved |= buffer;
+	if (!controller.LoadBuffer(buffer, frame, true))
+	{ // Not loaded: hand it back to Send()
+		tx_reserved &= ~buffer;
+		return false;
+	}
+	set_priority(buffer, CAN_ArbitrationKey(frame)); // Ranked against the buffers pending now
 	return true;
 }
+
+void CAN_IO_Base::Trigger(uint8_t buffers)
+{
+	buffers &= tx_reserved & tx_open;
+	if (!buffers)
+		return;
+
+	// Rank them again with their Preload() keys: the buffers pending now may differ from
+	// those at Preload(), and the triggered ones go after pending frames with the same ID.
+	for (byte n = 0; n < 3; n++)
+		if (buffers & (1 << n))
+			tx_seq[n] = ++tx_loads;
+	rank_buffers((~tx_open & 0x07) | buffers);
+
+	controller.SendBuffer(buffers);
+	tx_open &= ~buffers;
+}
+
+void CAN_IO_Base::Release(uint8_t buffers)
+{
+	tx_reserved &= ~buffers;
+}
+
 // RX filters for Standard IDs (SID)
 // Define two macros for the following function, to improve readability.
-void CAN_IO::write_rx_filter(uint8_t address, uint16_t data)
+void CAN_IO_Base::write_rx_filter(uint8_t address, uint16_t data)
 {
 	// FOR LEGACY, GENERATES SID
 	write_rx_filter(address, data, false);
@@ -362,7 +716,7 @@ void CAN_IO::write_rx_filter(uint8_t address, uint16_t data)
 #define B2_E(value) uint8_t((value >> (29 - 16) & B11100000) | B00001000 | (value >> (29-13)) & B111)
 #define B3_E(value) uint8_t((value >> (29 - 21)) & 0x00FF)
 #define B4_E(value) uint8_t(value & 0x00FF)
-void CAN_IO::write_rx_filter(uint8_t address, uint32_t data, bool eid)
+void CAN_IO_Base::write_rx_filter(uint8_t address, uint32_t data, bool eid)
 {
 	uint8_t bytes[4] = {}; // initialize to all 0s
 	if (eid) // Extended ID
@@ -381,7 +735,7 @@ void CAN_IO::write_rx_filter(uint8_t address, uint32_t data, bool eid)
 }
 
 // For writing mask of EIDs
-void CAN_IO::write_rx_mask(uint8_t address, uint32_t data, bool eid)
+void CAN_IO_Base::write_rx_mask(uint8_t address, uint32_t data, bool eid)
 {
 	uint8_t bytes[4] = {}; // initialize to all 0s
 	if (eid)
@@ -402,42 +756,37 @@ void CAN_IO::write_rx_mask(uint8_t address, uint32_t data, bool eid)
 	controller.Write(address, bytes, 4);
 }
 
-inline uint8_t CAN_IO::select_open_buffer()
+inline uint8_t CAN_IO_Base::select_open_buffer()
 {
-	if (this->tx_open & TXB0)
+	byte open = this->tx_open & ~this->tx_reserved;
+	if (open & TXB0)
 		return TXB0;
-	else if (this->tx_open & TXB1)
+	else if (open & TXB1)
 		return TXB1;
-	else if (this->tx_open & TXB2)
+	else if (open & TXB2)
 		return TXB2;
 	else
 		return 0x00; //Failure
 }
 
-bool CAN_IO::ConfigureInterrupts(byte interrupts)
+bool CAN_IO_Base::ConfigureInterrupts(byte interrupts)
 {
-
-	if (controller.Mode(MODE_CONFIG))
-	{
-		controller.Write(CANINTE, interrupts);
-		if (controller.Mode(MODE_NORMAL))
-		{
-			my_interrupts = interrupts;
-			return true;
-		}
-		else
-			return false;
-	}
-	else
-		return false;
+	// CANINTE can be written in any mode, so there is no need to go through config mode.
+	controller.Write(CANINTE, interrupts);
+	my_interrupts = interrupts;
+	return controller.Read(CANINTE) == interrupts;
 }
 
-void CAN_IO::setAutoFetch(bool set)
+bool CAN_IO_Base::setAutoFetch(bool set)
 {
+	if (INT_pin == MCP2515_NO_PIN)
+		return !set; // Nothing to attach to
+
 	if (set)
 		attachInterrupt(INT_pin, CAN_ISR, LOW);
 	else
 		detachInterrupt(INT_pin);
+	return true;
 }
 
 #undef first_byte
@@ -11,6 +11,10 @@
 #include "includes/MCP2515_defs.h"
 #include "includes/Layouts.h"
 #include "includes/RX_Queue.h"
+#include "includes/TX_Queue.h"
+#include "includes/CAN_Mailbox.h"
+#include "includes/CAN_Stats.h"
+#include "includes/CAN_Scheduler.h"
 
 /* 
  *Struct containing the filter info for the rx buffers.
@@ -83,23 +87,18 @@ struct CANFilterOpt {
   #define CANERR_SETUP_BAUDFAIL   	0x0100 // Failed to set baud rate properly during setup (can mean that SPI is wired incorrectly)
   #define CANERR_SETUP_MODEFAIL   	0x0200 // Failed to switch modes (can mean that SPI is wired incorrectly)
   #define CANERR_RXBUFFER_FULL    	0x0400 // Local buffer is full
+  #define CANERR_TXBUFFER_FULL    	0x0800 // Local TX queue was full, so Send() dropped a frame
   #define CANERR_MESSAGE_ERROR	  	0x1000 // Message transmission error 
   #define CANERR_BUSOFF_MODE	  	0x2000 // MCP2515 has entered Bus Off mode
   #define CANERR_HIGH_ERROR_COUNT	0x4000 // Triggered when TEC or REC exceeds 96
 
 /*
  * Class for handling CAN I/O operations using the
- * MCP2515 CAN controller.
+ * MCP2515 CAN controller. This holds everything that does not depend
+ * on the queue sizes; use CAN_IO (or CAN_IO_T) to create one.
  */
-class CAN_IO {
+class CAN_IO_Base {
 public:
-	/*
-	 * Constructor. Creates a MCP2515 object using
-	 * the given pins.
-	 */
-	CAN_IO(byte CS_pin, byte INT_pin, int baud, byte freq); // Constructor for using interrupts
-	CAN_IO(byte CS_pin, int baud, byte freq);								// Constructor if interrupts are not used
-
 	/*
 	 * Initializes the CAN controller to desired settings,
 	 * including read masks/filters. All types of interrupt
@@ -111,9 +110,12 @@ public:
 
 	/*
 	 * Methods to put the controller to sleep or wake it up again.
+	 * The callback version of Wake() returns immediately. Fetch() finishes the mode change and
+	 * calls the callback when the controller is back in normal mode (or the request times out).
 	 */
 	bool Sleep();
 	bool Wake();
+	void Wake(ModeCallback callback);
 
 	void ResetController();
 	
@@ -126,12 +128,52 @@ public:
 	/*
 	 * Attaches or detatches the automatic fetch interrupt (not recommended)
 	 * Arguments: set (true = attach interrupt pin to the CAN_ISR routine, false = detatch interrupt from the interrupt pin [default])
+	 * Returns false if set is true but the CAN_IO was made without an INT pin.
+	 */
+	bool setAutoFetch(bool set);
+
+	/*
+	 * Enables or disables the fast receive path in Fetch(). When set, the RX buffers are found
+	 * with a single RX STATUS command and drained with READ RX BUFFER, which clears RXnIF on its
+	 * own, so no CANINTF read or bit modify is needed for received frames.
+	 * Other interrupts (TXnIF, ERRIF...) are still read from CANINTF if they are enabled.
+	 */
+	void setFastReceive(bool set) { fast_rx = set; }
+
+	/*
+	 * Attaches a mailbox table (or detaches it with 0). Fetch() then stores frames with a
+	 * registered ID in their mailbox instead of queueing them; other frames still go to RXbuffer.
+	 *   CAN_MailboxTable<8> latest;
+	 *   latest.add(BMS_VCSOC_ID);
+	 *   can.setMailbox(&latest);
+	 */
+	void setMailbox(CAN_Mailbox* table) { mailbox = table; }
+
+	/*
+	 * Attaches per-ID arrival statistics (or detaches them with 0). Fetch() records every
+	 * received frame's timestamp in them.
 	 */
-	void setAutoFetch(bool set);
+	void setStats(CAN_Stats* table) { stats = table; }
+
+	/*
+	 * Attaches a periodic transmit schedule (or detaches it with 0). Poll() then sends
+	 * every message that is due:
+	 *   CAN_SchedulerTable<4> schedule;
+	 *   schedule.add(heartbeat, 500); // every 500 ms, phase picked automatically
+	 *   can.setScheduler(&schedule);
+	 */
+	void setScheduler(CAN_Scheduler* table) { scheduler = table; }
+
+	/*
+	 * Sends the scheduled messages that are due, through TXbuffer. Call it every loop.
+	 * Returns the number of frames queued.
+	 */
+	int Poll();
 
 	/*
 	 * Invoked when the interrupt pin is pulled low. Handles
 	 * errors or reads messages, determined by the type of interrupt.
+	 * Also polls any pending mode change made with controller.RequestMode().
 	 */
 	void Fetch();
 
@@ -145,33 +187,131 @@ public:
 	 */
 	void FetchStatus();
 
+	/*
+	 * Updates tec, rec, errors, canstat_register and last_interrupt together, using two burst reads.
+	 * Cheaper than calling FetchErrors() and FetchStatus() when polling every loop.
+	 */
+	void FetchHealth();
+
 	/*
 	 * Sends messages to the CAN bus via the controller.
+	 * With TXBANY the frame goes through TXbuffer: it is loaded at once if a TX buffer is open,
+	 * otherwise it waits until Fetch() sees that one has finished. Buffers whose TXnIE interrupt
+	 * is enabled are reopened by TXnIF; the others are polled with READ STATUS (one 2 byte
+	 * transaction, only while a buffer is busy), so TX interrupts can be left off. A polled buffer
+	 * that finished has its TXBnCTRL read, so an aborted or failed frame is requeued, not lost.
+	 * TXbuffer hands out the highest priority (lowest ID) frame first; frames with the same ID
+	 * keep their order. Returns false if TXbuffer is full (see CANERR_TXBUFFER_FULL).
 	 */
 	bool Send(const Layout& layout, uint8_t buffer);
 	bool Send(const Frame& frame, uint8_t buffer);
 	bool SendVerified(const Layout& layout, uint8_t buffer);
 	bool SendVerified(const Frame& frame, uint8_t buffer);
+
+	/*
+	 * Sends a layout of a type known at compile time without building a Frame: its encode()
+	 * writes the TX buffer registers into an image on the stack, and controller.LoadImage()
+	 * clocks that out as is. Layouts without their own encode() go through generate_frame().
+	 * SendImage() sends an image the caller filled in. With TXBANY the image is loaded at once
+	 * only if TXbuffer is empty and a TX buffer is open; otherwise it is queued like Send().
+	 */
+	template<class L>
+	bool SendDirect(const L& layout, uint8_t buffer)
+	{
+		MCP2515_TXImage image;
+		layout.encode(image);
+		return SendImage(image, buffer);
+	}
+	bool SendImage(MCP2515_TXImage& image, uint8_t buffer);
+
+	/*
+	 * Methods for frames that must go out with low, fixed latency.
+	 * Preload() loads a frame into a TX buffer without sending it, and keeps Send(..., TXBANY)
+	 * from using that buffer (unless the load fails verification). Trigger() sends the ORed buffers. If their TXnRTS pins were set up with
+	 * controller.SetPinModes() (before Setup()), this is a pin pulse with no SPI traffic. The frame stays
+	 * loaded, so Trigger() can be called again once it has gone out. Release() hands the buffers back to Send().
+	 */
+	bool Preload(const Frame& frame, uint8_t buffer);
+	void Trigger(uint8_t buffers);
+	void Release(uint8_t buffers);
+
+	/*
+	 * Reads back the frames in TX buffers that stopped without being sent (aborted with
+	 * controller.AbortTransmissions(), or lost arbitration or hit an error in one-shot mode)
+	 * and puts them back in TXbuffer, ahead of the frames queued later with the same ID.
+	 * Fetch() calls this on a message error; call it yourself after aborting.
+	 * Returns the number of frames requeued.
+	 */
+	byte RecoverTransmissions();
+
+	/*
+	 * Returns the number of frames waiting in TXbuffer.
+	 */
+	int TXPending() { return tx_queue->size(); }
 	
+	/*
+	 * Gives frames received in RXB1 their own queue (or merges them back into RXbuffer with 0).
+	 * RXbuffer then only holds RXB0 frames, which match the higher priority filters (RXF0/RXF1),
+	 * so a burst of RXB1 telemetry can't push them out. Read(), Peek() and Available() drain
+	 * RXbuffer first. The lane can be any queue, e.g. RX_Queue<16, RXQ_OVERWRITE_SAME_ID>.
+	 */
+	void setRXB1Lane(Frame_Lane* lane) { rxb1_lane = lane; }
+
 	/*
 	 * Returns a reference to the next available frame on the buffer
 	 */
 	inline Frame& Read()
 	{
-		return RXbuffer.dequeue();
+		if (rxb1_lane && rxb0_lane->is_empty() && !rxb1_lane->is_empty())
+			return rxb1_lane->dequeue();
+		return rxb0_lane->dequeue();
 	}
       
+	/*
+	 * Zero-copy receive. Peek() returns the oldest frame (0 if there is none) and leaves it in
+	 * its queue, where Fetch() will not overwrite it, until Commit() releases it:
+	 *   if (const Frame* f = can.Peek()) { TRI88_Drive d(*f); can.Commit(); }
+	 */
+	inline const Frame* Peek()
+	{
+		Frame_Lane* lane = rxb0_lane;
+		if (rxb1_lane && rxb0_lane->is_empty())
+			lane = rxb1_lane;
+		const Frame* f = lane->peek();
+		peek_lane = f ? lane : 0; // Nothing for Commit() to release if both were empty
+		return f;
+	}
+
+	inline void Commit()
+	{
+		if (peek_lane)
+			peek_lane->commit();
+		peek_lane = 0;
+	}
+
+	/*
+	 * Bulk receive, for nodes that handle many frames per loop. ReadMany() copies up to n
+	 * frames into out; Drain() passes up to n frames to fn straight from the queue. Each queue
+	 * is emptied in one pass instead of a call per frame, RXbuffer first as with Read().
+	 * Both return the number of frames handed over. If dropped is given, it gets the number of
+	 * frames lost to overflow so far (RXbuffer plus the RXB1 lane), read just before the pass.
+	 *   Frame batch[8];
+	 *   int n = can.ReadMany(batch, 8);
+	 *   can.Drain(log_frame);	// void log_frame(const Frame& f, void* context)
+	 */
+	int ReadMany(Frame* out, int n, uint32_t* dropped = 0);
+	int Drain(FrameCallback fn, void* context = 0, int n = 255, uint32_t* dropped = 0);
+
 	/*
 	 * Returns true if the RX buffer is not empty.
 	 */
 	inline bool Available()
 	{
-		return !RXbuffer.is_empty();
+		return !rxb0_lane->is_empty() || (rxb1_lane && !rxb1_lane->is_empty());
 	}
 
         
     MCP2515 controller; // The MCP2515 object
-   	RX_Queue<8> RXbuffer; //A queue for holding incoming messages
 
     // Status data
     volatile uint8_t  canstat_register;
@@ -188,12 +328,32 @@ public:
 
 	//store filters
 	CANFilterOpt filters;
+
+protected:
+	/*
+	 * Constructor. rx is the queue for RXB0 frames (and RXB1 frames without a lane of their own),
+	 * tx the queue for frames sent with TXBANY.
+	 */
+	CAN_IO_Base(Frame_Lane& rx, Frame_Deque& tx, MCP2515_Transport& transport, int baud, byte freq, byte INT_pin);
 	
 private:
   	byte    INT_pin;
 	int 	  bus_speed;
 	byte	  bus_freq;
 	volatile byte 		tx_open;	// Tracks which TX buffers are open.
+	byte	  tx_reserved;	// TX buffers held by Preload()
+	bool	  fast_rx;	// Use the RX STATUS receive path in Fetch()
+	CAN_Mailbox* mailbox;	// Latest-value store for registered IDs (optional)
+	CAN_Stats* stats;		// Arrival statistics (optional)
+	CAN_Scheduler* scheduler;	// Periodic transmit schedule (optional)
+	Frame_Lane* rxb0_lane;	// RXbuffer of the CAN_IO_T
+	Frame_Lane* rxb1_lane;	// Queue for RXB1 frames (optional, RXbuffer otherwise)
+	Frame_Lane* peek_lane;	// Queue the last Peek() came from
+	Frame_Deque* tx_queue;	// TXbuffer of the CAN_IO_T
+	uint32_t  tx_key[3];	// CAN_ArbitrationKey() of the frame last loaded into each TX buffer
+	byte	  tx_prio[3];	// TXP last written to each TXBnCTRL
+	byte	  tx_seq[3];	// Load order of the TX buffers, for frames with the same ID
+	byte	  tx_loads;		// Counter behind tx_seq
 
 	// Store interrupts in case we have to reset
 	byte my_interrupts;
@@ -209,17 +369,143 @@ private:
 	
 	inline void init_controller();
 
+	/*
+	 * Helper function to update errors from the EFLG register.
+	 */
+	inline void update_errors(byte eflg);
+
+	/*
+	 * Helper function to read an RX buffer, timestamp the frame and route it to its
+	 * mailbox, the RXB1 lane or RXbuffer.
+	 */
+	inline void receive(byte buffer, unsigned long stamp);
+
+	/*
+	 * Helper function for the fast receive path. Reads any full RX buffers into RXbuffer.
+	 */
+	inline void fetch_rx();
+
+	/*
+	 * Helper function that adds up the frames the RX queues have dropped.
+	 */
+	inline uint32_t dropped_frames();
+
+	/*
+	 * Helper function to update CANERR_RXBUFFER_FULL after receiving.
+	 */
+	inline void check_rx_full();
+
 	/*
 	 * Helper function to select a TX buffer
 	 */
 	inline uint8_t select_open_buffer();
+
+	/*
+	 * Helper function to load queued frames into the open TX buffers.
+	 */
+	inline void send_queued();
+
+	/*
+	 * Helper function that reopens the closed TX buffers without a TXnIE interrupt once
+	 * they finish, using one READ STATUS. Returns true if any reopened.
+	 */
+	inline bool poll_tx();
+
+	/*
+	 * Helper function that reopens the ORed TX buffers that have finished, and puts the frames
+	 * of those that stopped without sending back in TXbuffer. Returns the number requeued.
+	 */
+	inline byte recover_buffers(byte buffers);
+
+	/*
+	 * Helper function to set a TX buffer's TXP from its frame's CAN_ArbitrationKey(), before it is sent.
+	 */
+	inline void set_priority(uint8_t buffer, uint32_t key);
+
+	/*
+	 * Helper function to set the TXP of the ORed pending buffers from their tx_key and tx_seq.
+	 */
+	inline void rank_buffers(byte pending);
+};
+
+/*
+ * The transport a CAN_IO_Q creates for the pin constructors. It is a base listed before
+ * CAN_IO_Base, so it is constructed before the controller is given it.
+ */
+template<class Transport>
+struct CAN_IO_Transport {
+	CAN_IO_Transport(byte CS_pin = MCP2515_NO_PIN, byte INT_pin = MCP2515_NO_PIN) : pins(CS_pin, INT_pin) {}
+	Transport pins;
+};
+
+/*
+ * With MCP2515_Transport, only the constructor taking a transport can be used, and nothing is stored.
+ */
+template<>
+struct CAN_IO_Transport<MCP2515_Transport> {
 };
 
+/*
+ * CAN_IO with the type of its receive queue given. RXQueue can be any Frame_Lane, e.g.
+ * RX_Queue<16, RXQ_EVICT_LOWEST_PRIORITY>, which keeps drive commands over telemetry when
+ * the queue is full. RX_Queue disables interrupts around each access, so auto-fetch still works.
+ * Transport is what the pin constructors create; make it MCP2515_Transport to save its RAM when
+ * another transport is always passed in.
+ *   CAN_IO_Q<RX_Queue<16, RXQ_EVICT_LOWEST_PRIORITY> > drive(CS, INT, 500, 16);
+ */
+template<class RXQueue, int TXDepth = 4, class Transport = MCP2515_SPI>
+class CAN_IO_Q : private CAN_IO_Transport<Transport>, public CAN_IO_Base {
+public:
+	/*
+	 * Constructor. Creates a MCP2515 object using
+	 * the given pins.
+	 */
+	CAN_IO_Q(byte CS_pin, byte INT_pin, int baud, byte freq) // Constructor for using interrupts
+		: CAN_IO_Transport<Transport>(CS_pin, INT_pin), CAN_IO_Base(RXbuffer, TXbuffer, this->pins, baud, freq, INT_pin) {}
+	CAN_IO_Q(byte CS_pin, int baud, byte freq) // Constructor if interrupts are not used
+		: CAN_IO_Transport<Transport>(CS_pin, MCP2515_NO_PIN), CAN_IO_Base(RXbuffer, TXbuffer, this->pins, baud, freq, MCP2515_NO_PIN) {}
+	CAN_IO_Q(MCP2515_Transport& transport, int baud, byte freq, byte INT_pin = MCP2515_NO_PIN) // Constructor for another SPI transport
+		: CAN_IO_Base(RXbuffer, TXbuffer, transport, baud, freq, INT_pin) {}
+
+	RXQueue RXbuffer; //A queue for holding incoming messages
+	TX_Queue<TXDepth> TXbuffer; //Frames waiting for a TX buffer, in priority order
+};
+
+/*
+ * CAN_IO with its queues set at compile time.
+ * RXDepth is the number of frames RXbuffer holds (a power of two, up to 128). FrameT is the
+ * type it stores them as: Frame, or CompactFrame to save RAM at the cost of a copy per Read().
+ * CompactFrame has no timestamp, so frames read from such a queue have timestamp 0; stats
+ * and the mailbox get the frame before it is queued, so they still see it.
+ * TXDepth is the number of frames TXbuffer holds while the three TX buffers are busy.
+ * RXbuffer is an SPSC_Queue (lock-free, Fetch() may run in an interrupt), which drops new
+ * frames when full; use CAN_IO_Q for another overflow policy.
+ *   CAN_IO_T<2> node(CS, INT, 500, 16);                // reads a couple of IDs
+ *   CAN_IO_T<64, CompactFrame> logger(CS, INT, 500, 16); // telemetry logger
+ *   CAN_IO_T<8, Frame, 16> sender(CS, INT, 500, 16);     // sends bursts
+ * Transport is as for CAN_IO_Q.
+ */
+template<int RXDepth = 8, class FrameT = Frame, int TXDepth = 4, class Transport = MCP2515_SPI>
+class CAN_IO_T : public CAN_IO_Q<SPSC_Queue<RXDepth, FrameT>, TXDepth, Transport> {
+public:
+	CAN_IO_T(byte CS_pin, byte INT_pin, int baud, byte freq)
+		: CAN_IO_Q<SPSC_Queue<RXDepth, FrameT>, TXDepth, Transport>(CS_pin, INT_pin, baud, freq) {}
+	CAN_IO_T(byte CS_pin, int baud, byte freq)
+		: CAN_IO_Q<SPSC_Queue<RXDepth, FrameT>, TXDepth, Transport>(CS_pin, baud, freq) {}
+	CAN_IO_T(MCP2515_Transport& transport, int baud, byte freq, byte INT_pin = MCP2515_NO_PIN)
+		: CAN_IO_Q<SPSC_Queue<RXDepth, FrameT>, TXDepth, Transport>(transport, baud, freq, INT_pin) {}
+};
+
+/*
+ * The standard CAN_IO: an 8 frame receive queue and a 4 frame transmit queue.
+ */
+typedef CAN_IO_T<8> CAN_IO;
+
 /*
  * Declare a pointer to the main can_io instance. We need this because interrupt functions
  * can't have arguments. We can't assign CAN_IO::Fetch() to the ISR because it has an implicit
  * this* pointer which goes to the specific instance. If you want multiple can controllers,
  * you will need to set up your own interrupts for them.
  */
-extern CAN_IO* main_CAN;
+extern CAN_IO_Base* main_CAN;
 #endif
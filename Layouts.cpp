@@ -30,6 +30,18 @@ inline void Layout::set_header(Frame &f, byte size) const
 	f.srr = 0;
 }
 
+inline void Layout::set_header(MCP2515_TXImage &image, byte size) const
+{
+	MCP2515::EncodeHeader(id, id > 0xffff, false, size, image.header);
+}
+
+void Layout::encode(MCP2515_TXImage &image) const
+{
+	Frame f = generate_frame();
+	MCP2515::EncodeHeader(f, image.header);
+	image.value = f.value;
+}
+
 
 Frame TRI88_Drive::generate_frame() const
 {
@@ -40,6 +52,13 @@ Frame TRI88_Drive::generate_frame() const
   return f;
 }
 
+void TRI88_Drive::encode(MCP2515_TXImage &image) const
+{
+  image.low_f = velocity;
+  image.high_f = current;
+  set_header(image);
+}
+
 
 Frame TRI88_Power::generate_frame() const
 {
@@ -49,6 +68,13 @@ Frame TRI88_Power::generate_frame() const
   return f;
 }
 
+void TRI88_Power::encode(MCP2515_TXImage &image) const
+{
+  image.low_f = bus_current;
+  image.high = UNUSED;
+  set_header(image);
+}
+
 Frame TRI88_Reset::generate_frame() const
 {
   Frame f;
@@ -56,6 +82,12 @@ Frame TRI88_Reset::generate_frame() const
   return f;
 }
 
+void TRI88_Reset::encode(MCP2515_TXImage &image) const
+{
+  image.value = UNUSED;
+  set_header(image);
+}
+
 Frame TRI88_Status::generate_frame() const
 {
   Frame f;
@@ -271,6 +303,15 @@ Frame BMS19_VCSOC::generate_frame() const
 	return f;
 }
 
+void BMS19_VCSOC::encode(MCP2515_TXImage &image) const
+{
+	image.value = UNUSED;
+	image.s0 = LBE(current);
+	image.s1 = LBE(voltage);
+	image.data[4] = packSOC;
+	set_header(image);
+}
+
 Frame BMS19_MinMaxTemp::generate_frame() const
 {
 	Frame f;
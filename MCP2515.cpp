@@ -12,7 +12,6 @@
 */
 
 #include "Arduino.h"
-#include "SPI.h"
 #include "includes/MCP2515.h"
 #include "includes/MCP2515_defs.h"
 
@@ -26,15 +25,18 @@ String frameToString(const Frame& f)
   return String(fstring);
 }
 
-MCP2515::MCP2515(byte CS_Pin, byte INT_Pin) {
-  pinMode(CS_Pin, OUTPUT);
-  digitalWrite(CS_Pin,HIGH);
+MCP2515::MCP2515(MCP2515_Transport& transport) {
+  _spi = &transport;
+  _txHeaderValid = 0;
+  _modeStatus = MODE_REQUEST_DONE;
+  _modeCallback = 0;
+  _autoBaudRate = 0;
+  _rtsPins = 0;
+  _bfPins = 0;
+}
 
-  pinMode(INT_Pin,INPUT);
-  digitalWrite(INT_Pin,HIGH);
-  
-  _CS = CS_Pin;
-  _INT = INT_Pin;
+void MCP2515::Begin() {
+  _spi->begin();
 }
 
 /*
@@ -48,31 +50,10 @@ MCP2515::MCP2515(byte CS_Pin, byte INT_Pin) {
   
   Sending a bus speed of 0 kbps initiates AutoBaud and returns zero if no
   baud rate could be determined.  There must be two other active nodes on the bus!
+  The standard CAN rates are tried, and the result is kept so later calls skip detection.
 */
 int MCP2515::Init(int CAN_Bus_Speed, byte Freq) {
-  if(CAN_Bus_Speed>0) {
-    if(_init(CAN_Bus_Speed, Freq, 1, false)) return CAN_Bus_Speed;
-  } else {
-      int i=0;
-      byte interruptFlags = 0;
-      for(i=5; i<1000; i=i+5) {
-        if(_init(i, Freq, 1, true)) {
-            // check for bus activity
-            Write(CANINTF,0);
-            delay(500); // need the bus to be communicating within this time frame
-            if(Interrupt()) {
-              // determine which interrupt flags have been set
-              interruptFlags = Read(CANINTF);
-              if(!(interruptFlags & MERRF)) {
-                // to get here we must have received something without errors
-                Mode(MODE_NORMAL);
-                  return i;
-              }
-            }
-        }
-      }
-  }
-  return 0;
+  return Init(CAN_Bus_Speed, Freq, 1);
 }
 
 int MCP2515::Init(int CAN_Bus_Speed, byte Freq, byte SJW) {
@@ -81,37 +62,88 @@ int MCP2515::Init(int CAN_Bus_Speed, byte Freq, byte SJW) {
   if(CAN_Bus_Speed>0) {
     if(_init(CAN_Bus_Speed, Freq, SJW, false)) return CAN_Bus_Speed;
   } else {
-      int i=0;
-      byte interruptFlags = 0;
-      for(i=5; i<1000; i=i+5) {
-        if(_init(i, Freq, SJW, true)) {
-            // check for bus activity
-            Write(CANINTF,0);
-            delay(500); // need the bus to be communicating within this time frame
-            if(Interrupt()) {
-              // determine which interrupt flags have been set
-              interruptFlags = Read(CANINTF);
-              if(!(interruptFlags & MERRF)) {
-                // to get here we must have received something without errors
-                Mode(MODE_NORMAL);
-                  return i;
-              }
-            }
+    // Use the rate found by an earlier auto-baud, so a reset doesn't have to listen again
+    if(_autoBaudRate>0 && _init(_autoBaudRate, Freq, SJW, false)) return _autoBaudRate;
+    _autoBaudRate = _autoBaud(Freq, SJW);
+    return _autoBaudRate;
+  }
+  return 0;
+}
+
+// Rates tried by auto-baud, most common first
+static const int autobaud_rates[] = {500, 250, 125, 1000, 800, 100, 50, 20, 10};
+
+// Listening time per rate on the first pass, in ms. Doubled on each pass that finds nothing.
+#define AUTOBAUD_WINDOW   50
+#define AUTOBAUD_PASSES   4
+
+int MCP2515::_autoBaud(byte Freq, byte SJW) {
+  // Each rate is tried in listen-only mode. A frame received without a message error means the
+  // rate is right. A message error means it is wrong, so we move on without waiting out the window.
+  unsigned int window = AUTOBAUD_WINDOW;
+  for(byte pass=0; pass<AUTOBAUD_PASSES; pass++, window*=2) {
+    for(byte i=0; i<sizeof(autobaud_rates)/sizeof(autobaud_rates[0]); i++) {
+      int rate = autobaud_rates[i];
+      if(!_init(rate, Freq, SJW, true)) continue;
+
+      Write(CANINTF,0);
+      unsigned long start = millis();
+      while(millis()-start < window) {
+        if(!Interrupt()) continue;
+
+        // determine which interrupt flags have been set
+        byte interruptFlags = Read(CANINTF);
+        if(interruptFlags & MERRF) break; // wrong rate
+        if(interruptFlags & (RX0IF | RX1IF)) {
+          // to get here we must have received something without errors
+          if(Mode(MODE_NORMAL)) return rate;
+          break;
         }
+        Write(CANINTF,0);
       }
+    }
   }
   return 0;
 }
 
-bool MCP2515::_init(int CAN_Bus_Speed, byte Freq, byte SJW, bool autoBaud) {
+/*
+  Initialize MCP2515 with bit timing registers worked out ahead of time,
+  e.g. controller.Init(MCP2515_BitTiming<500, 16>::value)
   
+  returns true if the registers were written and read back correctly
+*/
+bool MCP2515::Init(const MCP2515_Timing& timing) {
   // Reset MCP2515 which puts it in configuration mode
   Reset();
-  
-  // Calculate bit timing registers
+  return _configure(timing, false);
+}
+
+// Standard rates, worked out at compile time. 1000 kbps is not possible with an 8 MHz oscillator.
+static const MCP2515_TimingEntry standard_timings[] PROGMEM = {
+  MCP2515_TIMING_ENTRY(125, 8),  MCP2515_TIMING_ENTRY(125, 16),  MCP2515_TIMING_ENTRY(125, 20),
+  MCP2515_TIMING_ENTRY(250, 8),  MCP2515_TIMING_ENTRY(250, 16),  MCP2515_TIMING_ENTRY(250, 20),
+  MCP2515_TIMING_ENTRY(500, 8),  MCP2515_TIMING_ENTRY(500, 16),  MCP2515_TIMING_ENTRY(500, 20),
+                                 MCP2515_TIMING_ENTRY(1000, 16), MCP2515_TIMING_ENTRY(1000, 20)
+};
+
+bool MCP2515::_timing(int CAN_Bus_Speed, byte Freq, byte SJW, MCP2515_Timing& timing) {
+  // Look for the rate in the table first
+  for(byte i=0; i<sizeof(standard_timings)/sizeof(standard_timings[0]); i++) {
+    MCP2515_TimingEntry entry;
+    memcpy_P(&entry, &standard_timings[i], sizeof(entry));
+    if(entry.baud==CAN_Bus_Speed && entry.freq==Freq) {
+      if(entry.phseg2 <= SJW) return false; // PHSEG2 > SJW
+      timing.cnf1 = ((SJW-1) << 6) | entry.brp;
+      timing.cnf2 = entry.cnf2;
+      timing.cnf3 = entry.cnf3;
+      return true;
+    }
+  }
+
+  // Otherwise fall back to searching for the bit timing
   byte BRP;
   float TQ;
-  byte BT;
+  byte BT = 0;
   float tempBT;
 
   float NBT = 1.0 / (float)CAN_Bus_Speed * 1000.0; // Nominal Bit Time
@@ -123,12 +155,14 @@ bool MCP2515::_init(int CAN_Bus_Speed, byte Freq, byte SJW, bool autoBaud) {
         if(tempBT-BT==0) break;
       }
   }
+  if(BRP>=8) return false; // No prescaler gives a whole number of time quanta
   
   byte SPT = (0.7 * BT); // Sample point
   byte PRSEG = (SPT - 1) / 2;
   byte PHSEG1 = SPT - PRSEG - 1;
   byte PHSEG2 = BT - PHSEG1 - PRSEG - 1;
 
+#ifdef MCP2515_DEBUG
   if (Serial)
   {
     Serial.println(F("----Bus Speed Config Settings----"));
@@ -138,36 +172,60 @@ bool MCP2515::_init(int CAN_Bus_Speed, byte Freq, byte SJW, bool autoBaud) {
     Serial.println(TQ);
     Serial.print(F("BT: "));
     Serial.println(BT);
+    Serial.println(F("---------"));
   }
+#endif
 
   // Programming requirements
+  if(PRSEG < 1 || PHSEG1 < 1)
+  {
+    return false;
+  }
   if(PRSEG + PHSEG1 < PHSEG2) 
   {
+#ifdef MCP2515_DEBUG
     if (Serial) Serial.println(F("PRSEG + PHSEG1 >= PHSEG2. Increase Freq or decrease Bus Speed."));
+#endif
     return false;
   }
   if(PHSEG2 <= SJW) 
   {
+#ifdef MCP2515_DEBUG
     if (Serial) Serial.println(F("PHSEG2 > SJW. Decrease SJW to allow for higher resolution synchronization."));
+#endif
     return false;
   }
-
-  if (Serial)
-  {
-      Serial.println(F("---------"));
-  }
   
   byte BTLMODE = 1;
   byte __SAM = 0;
   
-  // Set registers
-  byte data = (((SJW-1) << 6) | BRP);
-  Write(CNF1, data);
-  Write(CNF2, ((BTLMODE << 7) | (__SAM << 6) | ((PHSEG1-1) << 3) | (PRSEG-1)));
-  Write(CNF3, (B10000000 | (PHSEG2-1)));
-  Write(TXRTSCTRL,0);
+  timing.cnf1 = (((SJW-1) << 6) | BRP);
+  timing.cnf2 = ((BTLMODE << 7) | (__SAM << 6) | ((PHSEG1-1) << 3) | (PRSEG-1));
+  timing.cnf3 = (B10000000 | (PHSEG2-1));
+  return true;
+}
+
+bool MCP2515::_init(int CAN_Bus_Speed, byte Freq, byte SJW, bool autoBaud) {
+  
+  // Reset MCP2515 which puts it in configuration mode
+  Reset();
   
-  if(!autoBaud) {
+  // Calculate bit timing registers
+  MCP2515_Timing timing;
+  if(!_timing(CAN_Bus_Speed, Freq, SJW, timing)) return false;
+
+  return _configure(timing, autoBaud);
+}
+
+bool MCP2515::_configure(const MCP2515_Timing& timing, bool listenOnly) {
+  // Set registers. CNF3, CNF2 and CNF1 are next to each other, so write them in one go.
+  byte cnf[3] = {timing.cnf3, timing.cnf2, timing.cnf1};
+  Write(CNF3, cnf, 3);
+  // TXnRTS and RXnBF pins are only used if SetPinModes() asked for them
+  Write(TXRTSCTRL,_rtsPins);
+  Write(BFPCTRL,_bfPins | (_bfPins<<2)); // BnBFM and BnBFE
+  
+  if(!listenOnly) {
     // Return to Normal mode
       if(!Mode(MODE_NORMAL)) return false;
   } else {
@@ -180,34 +238,36 @@ bool MCP2515::_init(int CAN_Bus_Speed, byte Freq, byte SJW, bool autoBaud) {
   // Test that we can read back from the MCP2515 what we wrote to it
   byte rtn = Read(CNF1);
 
-  return (rtn==data);
+  return (rtn==timing.cnf1);
 }
 
 void MCP2515::Reset() {
-  digitalWrite(_CS,LOW);
-  SPI.transfer(CAN_RESET);
-  digitalWrite(_CS,HIGH);
+  byte command = CAN_RESET;
+  _spi->transfer(&command, 0, 1);
+  InvalidateTXHeaders(); // TX buffer registers are cleared by a reset
 }
 
 byte MCP2515::Read(byte address) {
-  digitalWrite(_CS,LOW);
-  SPI.transfer(CAN_READ);
-  SPI.transfer(address);
-  byte data = SPI.transfer(0x00);
-  digitalWrite(_CS,HIGH);
-  return data;
+  byte buf[3] = {CAN_READ, address, 0x00};
+  _spi->transfer(buf, buf, 3);
+  return buf[2];
 }
 
 void MCP2515::Read(byte address, byte data[], byte bytes) {
   // allows for sequential reading of registers starting at address - see data sheet
-  byte i;
-  digitalWrite(_CS,LOW);
-  SPI.transfer(CAN_READ);
-  SPI.transfer(address);
-  for(i=0;i<bytes;i++) {
-    data[i] = SPI.transfer(0x00);
+  // Long reads are split into several transactions, which reads the same registers.
+  byte buf[MCP2515_MAX_TRANSFER];
+  while(bytes>0) {
+    byte n = (bytes > MCP2515_MAX_TRANSFER-2) ? MCP2515_MAX_TRANSFER-2 : bytes;
+    buf[0] = CAN_READ;
+    buf[1] = address;
+    memset(buf+2, 0, n);
+    _spi->transfer(buf, buf, n+2);
+    memcpy(data, buf+2, n);
+    address += n;
+    data += n;
+    bytes -= n;
   }
-  digitalWrite(_CS,HIGH);
 }
 
 Frame MCP2515::ReadBuffer(byte buffer) {
@@ -216,14 +276,19 @@ Frame MCP2515::ReadBuffer(byte buffer) {
   // buffer should be either RXB0 or RXB1
   
   Frame message;
-  
-  digitalWrite(_CS,LOW);
-  SPI.transfer(CAN_READ_BUFFER | (buffer<<1));
-  byte byte1 = SPI.transfer(0x00); // RXBnSIDH
-  byte byte2 = SPI.transfer(0x00); // RXBnSIDL
-  byte byte3 = SPI.transfer(0x00); // RXBnEID8
-  byte byte4 = SPI.transfer(0x00); // RXBnEID0
-  byte byte5 = SPI.transfer(0x00); // RXBnDLC
+  byte buf[14] = {byte(CAN_READ_BUFFER | (buffer<<1))}; // Instruction, then RXBnSIDH to RXBnD7
+  _spi->transfer(buf, buf, 14);
+  DecodeFrame(buf+1, message);
+
+  return message;
+}
+
+void MCP2515::DecodeFrame(const byte raw[13], Frame& message) {
+  byte byte1 = raw[0]; // RXBnSIDH
+  byte byte2 = raw[1]; // RXBnSIDL
+  byte byte3 = raw[2]; // RXBnEID8
+  byte byte4 = raw[3]; // RXBnEID0
+  byte byte5 = raw[4]; // RXBnDLC
 
   message.srr=(byte2 & B00010000);
   message.ide=(byte2 & B00001000);
@@ -239,12 +304,10 @@ Frame MCP2515::ReadBuffer(byte buffer) {
 
   message.rtr=(byte5 & B01000000);
   message.dlc = (byte5 & B00001111);  // Number of data bytes
+  if(message.dlc>8) message.dlc = 8;
   for(int i=0;i<message.dlc;i++) {
-    message.data[i] = SPI.transfer(0x00);
+    message.data[i] = raw[5+i];
   }
-  digitalWrite(_CS,HIGH);
-
-  return message;
 }
 
 byte MCP2515::CheckBuffers()
@@ -253,74 +316,113 @@ byte MCP2515::CheckBuffers()
    return (rxStatus & 0xC0) >> 5; 
 }
 
+void MCP2515::SetPinModes(byte rts, byte bf) {
+  _rtsPins = rts & (B0RTSM | B1RTSM | B2RTSM);
+  _bfPins = bf & (B0BFM | B1BFM);
+}
+
+byte MCP2515::BufferFull() {
+  byte full;
+  if(BufferPins() && _spi->bufferFull(full)) return full;
+
+  byte rxStatus = RXStatus();
+  return ((rxStatus & RXSTAT_RX0IF) ? RX0IF : 0) | ((rxStatus & RXSTAT_RX1IF) ? RX1IF : 0);
+}
+
 void MCP2515::Write(byte address, byte data) {
-  digitalWrite(_CS,LOW);
-  SPI.transfer(CAN_WRITE);
-  SPI.transfer(address);
-  SPI.transfer(data);
-  digitalWrite(_CS,HIGH);
+  if(address>=TXB0SIDH && address<=TXB2DLC) InvalidateTXHeaders();
+  byte buf[3] = {CAN_WRITE, address, data};
+  _spi->transfer(buf, 0, 3);
 }
 
 void MCP2515::Write(byte address, byte data[], byte bytes) {
   // allows for sequential writing of registers starting at address - see data sheet
-  byte i;
-  digitalWrite(_CS,LOW);
-  SPI.transfer(CAN_WRITE);
-  SPI.transfer(address);
-  for(i=0;i<bytes;i++) {
-    SPI.transfer(data[i]);
+  // Long writes are split into several transactions, like Read().
+  if(address<=TXB2DLC && address+bytes>TXB0SIDH) InvalidateTXHeaders();
+  byte buf[MCP2515_MAX_TRANSFER];
+  while(bytes>0) {
+    byte n = (bytes > MCP2515_MAX_TRANSFER-2) ? MCP2515_MAX_TRANSFER-2 : bytes;
+    buf[0] = CAN_WRITE;
+    buf[1] = address;
+    memcpy(buf+2, data, n);
+    _spi->transfer(buf, 0, n+2);
+    address += n;
+    data += n;
+    bytes -= n;
   }
-  digitalWrite(_CS,HIGH);
 }
 
 void MCP2515::SendBuffer(byte buffers) {
   // buffers should be any combination of TXB0, TXB1, TXB2 ORed together, or TXB_ALL
-  digitalWrite(_CS,LOW);
-  SPI.transfer(CAN_RTS | buffers);
-  digitalWrite(_CS,HIGH);
+  // If every buffer has its TXnRTS pin in request-to-send mode, a pin pulse is enough.
+  if(buffers && !(buffers & ~_rtsPins) && _spi->requestToSend(buffers)) return;
+  byte command = CAN_RTS | buffers;
+  _spi->transfer(&command, 0, 1);
 }
 
-bool MCP2515::LoadBuffer(byte buffer, Frame message, bool verify) {
+void MCP2515::EncodeHeader(const Frame& message, byte header[5]) {
+  EncodeHeader(message.id, message.ide, message.rtr, message.dlc, header);
+}
+
+void MCP2515::EncodeHeader(unsigned long id, bool ide, bool rtr, byte dlc, byte header[5]) {
+  uint32_t id32 = id; // The shifts below assume a 32 bit ID
+  if(ide) {
+    header[0] = byte((id32<<3)>>24); // 8 MSBits of SID
+    header[1] = byte((id32<<11)>>24) & B11100000; // 3 LSBits of SID
+    header[1] = header[1] | byte((id32<<14)>>30); // 2 MSBits of EID
+    header[1] = header[1] | B00001000; // EXIDE
+    header[2] = byte((id32<<16)>>24); // EID Bits 15-8
+    header[3] = byte((id32<<24)>>24); // EID Bits 7-0
+  } else {
+    header[0] = byte((id32<<21)>>24); // 8 MSBits of SID
+    header[1] = byte((id32<<29)>>24) & B11100000; // 3 LSBits of SID
+    header[2] = 0; // TXBnEID8
+    header[3] = 0; // TXBnEID0
+  }
+  header[4] = dlc;
+  if(rtr) {
+    header[4] = header[4] | B01000000;
+  }
+}
+
+void MCP2515::InvalidateTXHeaders() {
+  _txHeaderValid = 0;
+}
+
+bool MCP2515::LoadBuffer(byte buffer, const Frame& message, bool verify) {
  
   // buffer should be one of TXB0, TXB1 or TXB2
   if(buffer==TXB0) buffer = 0;
 
-  byte byte1=0; // TXBnSIDH
-  byte byte2=0; // TXBnSIDL
-  byte byte3=0; // TXBnEID8
-  byte byte4=0; // TXBnEID0
-  byte byte5=0; // TXBnDLC
-
-  if(message.ide) {
-    byte1 = byte((message.id<<3)>>24); // 8 MSBits of SID
-    byte2 = byte((message.id<<11)>>24) & B11100000; // 3 LSBits of SID
-    byte2 = byte2 | byte((message.id<<14)>>30); // 2 MSBits of EID
-    byte2 = byte2 | B00001000; // EXIDE
-    byte3 = byte((message.id<<16)>>24); // EID Bits 15-8
-    byte4 = byte((message.id<<24)>>24); // EID Bits 7-0
+  byte header[5]; // TXBnSIDH, TXBnSIDL, TXBnEID8, TXBnEID0, TXBnDLC
+  EncodeHeader(message, header);
+
+  // If this buffer was last loaded with the same header, only the payload has to be sent.
+  // The abbreviated LOAD TX BUFFER address (buffer | 0x01) starts at TXBnD0.
+  byte index = buffer >> 1; // 0, 1 or 2
+  byte* cached = _txHeader[index];
+  bool same_header = (_txHeaderValid & (1 << index)) &&
+    cached[0] == header[0] && cached[1] == header[1] && cached[2] == header[2] &&
+    cached[3] == header[3] && cached[4] == header[4];
+
+  byte dlc = (message.dlc > 8) ? 8 : message.dlc;
+  byte buf[14];
+  byte n = 0;
+  if (same_header) {
+    buf[n++] = CAN_LOAD_BUFFER | buffer | 0x01;
   } else {
-    byte1 = byte((message.id<<21)>>24); // 8 MSBits of SID
-    byte2 = byte((message.id<<29)>>24) & B11100000; // 3 LSBits of SID
-    byte3 = 0; // TXBnEID8
-    byte4 = 0; // TXBnEID0
-  }
-  byte5 = message.dlc;
-  if(message.rtr) {
-    byte5 = byte5 | B01000000;
+    buf[n++] = CAN_LOAD_BUFFER | buffer;
+    for(int i=0;i<5;i++) {
+      buf[n++] = header[i];
+      cached[i] = header[i];
+    }
   }
-  
-  digitalWrite(_CS,LOW);
-  SPI.transfer(CAN_LOAD_BUFFER | buffer);  
-  SPI.transfer(byte1);
-  SPI.transfer(byte2);
-  SPI.transfer(byte3);
-  SPI.transfer(byte4);
-  SPI.transfer(byte5);
  
-  for(int i=0;i<message.dlc;i++) {
-    SPI.transfer(message.data[i]);
+  for(int i=0;i<dlc;i++) {
+    buf[n++] = message.data[i];
   }
-  digitalWrite(_CS,HIGH);
+  _spi->transfer(buf, 0, n);
+  _txHeaderValid |= (1 << index);
 
   if (verify)
   {
@@ -335,22 +437,26 @@ bool MCP2515::LoadBuffer(byte buffer, Frame message, bool verify) {
         buffer = TXB2SIDH; break;
     }
     byte registers[13];
-    Read(buffer, registers, 5+message.dlc);
+    Read(buffer, registers, 5+dlc);
       if (
-        byte1 != registers[0] or
-        byte2 != registers[1] or
-        byte3 != registers[2] or
-        byte4 != registers[3] or
-        byte5 != registers[4]
+        header[0] != registers[0] or
+        header[1] != registers[1] or
+        header[2] != registers[2] or
+        header[3] != registers[3] or
+        header[4] != registers[4]
         )
         {
+          InvalidateTXHeaders();
           return false;
         }
       else 
       {
-        for(int i=0;i<message.dlc;i++) {
+        for(int i=0;i<dlc;i++) {
           if (message.data[i] != registers[5+i])
+          {
+            InvalidateTXHeaders();
             return false;
+          }
         }
         return true;
       }
@@ -358,12 +464,34 @@ bool MCP2515::LoadBuffer(byte buffer, Frame message, bool verify) {
   else return true; // If not verifying, always return true.
 }
 
+void MCP2515::LoadImage(byte buffer, MCP2515_TXImage& image) {
+
+  // buffer should be one of TXB0, TXB1 or TXB2
+  if(buffer==TXB0) buffer = 0;
+
+  byte index = buffer >> 1; // 0, 1 or 2
+  byte* cached = _txHeader[index];
+  byte dlc = image.dlc();
+  if(dlc > 8) dlc = 8;
+
+  // Same header as last time: the abbreviated command goes in the byte before TXBnD0
+  // for this transfer, and TXBnDLC is put back afterwards.
+  if((_txHeaderValid & (1 << index)) && !memcmp(cached, image.header, 5)) {
+    image.header[4] = CAN_LOAD_BUFFER | buffer | 0x01;
+    _spi->transfer(&image.header[4], 0, 1 + dlc);
+    image.header[4] = cached[4];
+  } else {
+    image.command = CAN_LOAD_BUFFER | buffer;
+    _spi->transfer(&image.command, 0, 6 + dlc);
+    memcpy(cached, image.header, 5);
+    _txHeaderValid |= (1 << index);
+  }
+}
+
 byte MCP2515::Status() {
-  digitalWrite(_CS,LOW);
-  SPI.transfer(CAN_STATUS);
-  byte data = SPI.transfer(0x00);
-  digitalWrite(_CS,HIGH);
-  return data;
+  byte buf[2] = {CAN_STATUS, 0x00};
+  _spi->transfer(buf, buf, 2);
+  return buf[1];
   /*
   bit 7 - CANINTF.TX2IF
   bit 6 - TXB2CNTRL.TXREQ
@@ -377,11 +505,9 @@ byte MCP2515::Status() {
 }
 
 byte MCP2515::RXStatus() {
-  digitalWrite(_CS,LOW);
-  SPI.transfer(CAN_RX_STATUS);
-  byte data = SPI.transfer(0x00);
-  digitalWrite(_CS,HIGH);
-  return data;
+  byte buf[2] = {CAN_RX_STATUS, 0x00};
+  _spi->transfer(buf, buf, 2);
+  return buf[1];
   /*
   bit 7 - CANINTF.RX1IF
   bit 6 - CANINTF.RX0IF
@@ -403,42 +529,43 @@ byte MCP2515::RXStatus() {
 
 void MCP2515::BitModify(byte address, byte mask, byte data) {
   // see data sheet for explanation
-  digitalWrite(_CS,LOW);
-  SPI.transfer(CAN_BIT_MODIFY);
-  SPI.transfer(address);
-  SPI.transfer(mask);
-  SPI.transfer(data);
-  digitalWrite(_CS,HIGH);
+  byte buf[4] = {CAN_BIT_MODIFY, address, mask, data};
+  _spi->transfer(buf, 0, 4);
 }
 
 bool MCP2515::Interrupt() {
-  return (digitalRead(_INT)==LOW);
+  return _spi->interrupt();
 }
 
 bool MCP2515::ResetInterrupt(byte intSelect)
 {
   BitModify(CANINTF,intSelect,0x00);
+  return true;
 }
 
 byte MCP2515::GetInterrupt()
 {
-  digitalWrite(_CS, LOW); // Close all pending SPI transmissions
   return Read(CANINTF);
 }
 
 bool MCP2515::AbortTransmissions(byte timeout)
 {
-  BitModify(CANCTRL, 0x10, 0x10); // Set ABAT to 1 to cancel all pending transmissions
-  byte prev_millis = millis();
-  while (millis() < prev_millis+timeout)
+  BitModify(CANCTRL, ABAT, ABAT); // Set ABAT to 1 to cancel all pending transmissions
+  unsigned long prev_millis = millis();
+  bool cleared = false;
+  while (millis() - prev_millis < timeout)
   {
-    if (Status() & 0b01010100 == 0) //if all TXREQ bits are now cleared.
-      return true;
+    if ((Status() & 0b01010100) == 0) //if all TXREQ bits are now cleared.
+    {
+      cleared = true;
+      break;
+    }
   }
-  return false;
+  BitModify(CANCTRL, ABAT, 0x00); // ABAT stays set until cleared, and would abort every later frame too
+  return cleared;
 }
 
-bool MCP2515::Mode(byte mode) {
+bool MCP2515::Mode(byte mode, unsigned int timeout) {
   /*
   mode can be one of the following:
   MODE_CONFIG
@@ -447,8 +574,42 @@ bool MCP2515::Mode(byte mode) {
   MODE_SLEEP
   MODE_NORMAL
   */
-  BitModify(CANCTRL, 0b11100000, mode);
-  delay(10); // allow for any transmissions to complete
+  byte status = RequestMode(mode, timeout);
+  while(status==MODE_REQUEST_PENDING) {
+    status = PollMode();
+  }
+  return (status==MODE_REQUEST_DONE);
+}
+
+byte MCP2515::RequestMode(byte mode, unsigned int timeout, ModeCallback callback) {
+  // The mode changes once any pending transmissions are complete, so CANSTAT is polled
+  // instead of waiting a fixed time. If we are already in the mode the first poll matches.
+  _modeTarget = mode & MODE_MASK;
+  _modeTimeout = timeout;
+  _modeCallback = callback;
+  _modeStart = millis();
+  _modeStatus = MODE_REQUEST_PENDING;
+
+  BitModify(CANCTRL, MODE_MASK, _modeTarget);
+  return PollMode();
+}
+
+byte MCP2515::PollMode() {
+  if(_modeStatus!=MODE_REQUEST_PENDING) return _modeStatus;
+
   byte data = Read(CANSTAT); // check mode has been set
-  return ((data & mode)==mode);
+  if((data & MODE_MASK)==_modeTarget) {
+    _modeStatus = MODE_REQUEST_DONE;
+  } else if(millis()-_modeStart >= _modeTimeout) {
+    _modeStatus = MODE_REQUEST_TIMEOUT;
+  } else {
+    return MODE_REQUEST_PENDING;
+  }
+
+  if(_modeCallback) {
+    ModeCallback callback = _modeCallback;
+    _modeCallback = 0;
+    callback(_modeTarget, _modeStatus==MODE_REQUEST_DONE);
+  }
+  return _modeStatus;
 }
@@ -0,0 +1,102 @@
+/*
+ * MCP2515_Transport.cpp
+ * Implementation of the Arduino SPI transport.
+ */
+
+#include "Arduino.h"
+#include "SPI.h"
+#include "includes/MCP2515_defs.h"
+#include "includes/MCP2515_Transport.h"
+
+MCP2515_SPI::MCP2515_SPI(byte CS_Pin, byte INT_Pin) : _CS(CS_Pin), _INT(INT_Pin)
+{
+  _RTS[0] = _RTS[1] = _RTS[2] = MCP2515_NO_PIN;
+  _BF[0] = _BF[1] = MCP2515_NO_PIN;
+
+  if (_CS != MCP2515_NO_PIN) {
+    pinMode(_CS, OUTPUT);
+    digitalWrite(_CS, HIGH);
+  }
+
+  if (_INT != MCP2515_NO_PIN) {
+    pinMode(_INT, INPUT);
+    digitalWrite(_INT, HIGH);
+  }
+}
+
+void MCP2515_SPI::setRTSPins(byte TX0RTS_Pin, byte TX1RTS_Pin, byte TX2RTS_Pin)
+{
+  _RTS[0] = TX0RTS_Pin;
+  _RTS[1] = TX1RTS_Pin;
+  _RTS[2] = TX2RTS_Pin;
+
+  // TXnRTS are falling edge inputs on the MCP2515, so idle them high.
+  for (byte i = 0; i < 3; i++) {
+    if (_RTS[i] == MCP2515_NO_PIN) continue;
+    digitalWrite(_RTS[i], HIGH);
+    pinMode(_RTS[i], OUTPUT);
+  }
+}
+
+void MCP2515_SPI::setBufferPins(byte RX0BF_Pin, byte RX1BF_Pin)
+{
+  _BF[0] = RX0BF_Pin;
+  _BF[1] = RX1BF_Pin;
+
+  for (byte i = 0; i < 2; i++) {
+    if (_BF[i] != MCP2515_NO_PIN) pinMode(_BF[i], INPUT);
+  }
+}
+
+void MCP2515_SPI::begin()
+{
+  SPI.setClockDivider(10);
+  SPI.setDataMode(SPI_MODE0);
+  SPI.setBitOrder(MSBFIRST);
+  SPI.begin();
+}
+
+void MCP2515_SPI::transfer(const byte* tx, byte* rx, byte n)
+{
+  // SPI.transfer(buf, n) works in place, so copy the command into the receive buffer first.
+  byte scratch[MCP2515_MAX_TRANSFER];
+  if (!rx) rx = scratch;
+  if (rx != tx) memcpy(rx, tx, n);
+
+  digitalWrite(_CS, LOW);
+  SPI.transfer(rx, n);
+  digitalWrite(_CS, HIGH);
+}
+
+bool MCP2515_SPI::interrupt()
+{
+  // Without an INT pin, report it asserted so the caller always checks CANINTF
+  if (_INT == MCP2515_NO_PIN) return true;
+  return (digitalRead(_INT) == LOW);
+}
+
+bool MCP2515_SPI::requestToSend(byte buffers)
+{
+  // buffers uses the TXBn masks, which are bits 0-2
+  for (byte i = 0; i < 3; i++) {
+    if ((buffers & (1 << i)) && _RTS[i] == MCP2515_NO_PIN) return false;
+  }
+
+  for (byte i = 0; i < 3; i++) {
+    if (buffers & (1 << i)) digitalWrite(_RTS[i], LOW);
+  }
+  for (byte i = 0; i < 3; i++) {
+    if (buffers & (1 << i)) digitalWrite(_RTS[i], HIGH);
+  }
+  return true;
+}
+
+bool MCP2515_SPI::bufferFull(byte& full)
+{
+  if (_BF[0] == MCP2515_NO_PIN || _BF[1] == MCP2515_NO_PIN) return false;
+
+  full = 0;
+  if (digitalRead(_BF[0]) == LOW) full |= RX0IF;
+  if (digitalRead(_BF[1]) == LOW) full |= RX1IF;
+  return true;
+}
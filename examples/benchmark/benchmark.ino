@@ -0,0 +1,118 @@
+#include <CAN_IO.h>
+#include <SPI.h>
+#include <includes/MCP2515_Pinned.h>
+
+// Measures the time Fetch() takes per received frame, with the runtime-pin driver and with the
+// compile-time pin driver, and the time a layout takes to send with Send() (generate_frame(),
+// then a Frame copy into LoadBuffer()) and with SendDirect() (encode() into a TX image that is
+// clocked out as is). The MCP2515 is put in loopback mode, so no other node is needed.
+
+//CAN parameters
+const byte     CAN_CS        = 10;
+const byte     CAN_INT       = 2;
+const uint16_t CAN_BAUD_RATE = 500;
+const byte     CAN_FREQ      = 16;    // MUST BE the frequency of the oscillator you use
+
+const int      FRAMES        = 200;   // Frames measured per run
+
+// Both objects talk to the same MCP2515. Only one is set up at a time.
+CAN_IO runtimeCAN(CAN_CS, CAN_INT, CAN_BAUD_RATE, CAN_FREQ);
+
+MCP2515_PinnedSPI<CAN_CS, CAN_INT> pinnedSPI;
+CAN_IO pinnedCAN(pinnedSPI, CAN_BAUD_RATE, CAN_FREQ, CAN_INT);
+
+/*
+ * Sends FRAMES frames to ourselves and returns the average Fetch() time in microseconds.
+ */
+unsigned long benchmark(CAN_IO& can)
+{
+  can.Setup(RX0IE | RX1IE);
+  can.controller.Mode(MODE_LOOPBACK);
+
+  Frame f;
+  f.id = DC_DRIVE_ID;
+  f.dlc = 8;
+  f.value = 0x0123456789ABCDEFULL;
+
+  unsigned long total = 0;
+  int received = 0;
+  for (int i = 0; i < FRAMES; i++)
+  {
+    can.Send(f, TXB0);
+
+    unsigned long start = millis();
+    while (!can.controller.Interrupt() && millis() - start < 10) {}
+
+    unsigned long t0 = micros();
+    can.Fetch();
+    total += micros() - t0;
+
+    while (can.Available())
+    {
+      can.Read();
+      received++;
+    }
+  }
+
+  can.controller.Mode(MODE_NORMAL);
+  return received ? total / received : 0;
+}
+
+/*
+ * Sends FRAMES drive commands to ourselves through one TX buffer and returns the average time
+ * the send call takes in microseconds, with Send() or with SendDirect().
+ */
+unsigned long sendBenchmark(CAN_IO& can, bool direct)
+{
+  can.Setup(RX0IE | RX1IE);
+  can.controller.Mode(MODE_LOOPBACK);
+
+  TRI88_Drive drive(0, 0);
+
+  unsigned long total = 0;
+  for (int i = 0; i < FRAMES; i++)
+  {
+    drive.velocity = i; // New payload, same ID, as a control loop sends it
+
+    unsigned long t0 = micros();
+    if (direct)
+      can.SendDirect(drive, TXB0);
+    else
+      can.Send(drive, TXB0);
+    total += micros() - t0;
+
+    // Wait for the frame to come back, so TXB0 is free again
+    unsigned long start = millis();
+    while (!can.controller.Interrupt() && millis() - start < 10) {}
+    can.Fetch();
+    while (can.Available())
+      can.Read();
+  }
+
+  can.controller.Mode(MODE_NORMAL);
+  return total / FRAMES;
+}
+
+void setup() {
+  Serial.begin(9600);
+  while (!Serial) {}
+
+  Serial.print(F("Runtime pins:      "));
+  Serial.print(benchmark(runtimeCAN));
+  Serial.println(F(" us per frame"));
+
+  Serial.print(F("Compile-time pins: "));
+  Serial.print(benchmark(pinnedCAN));
+  Serial.println(F(" us per frame"));
+
+  Serial.print(F("Send(layout):       "));
+  Serial.print(sendBenchmark(pinnedCAN, false));
+  Serial.println(F(" us per frame"));
+
+  Serial.print(F("SendDirect(layout): "));
+  Serial.print(sendBenchmark(pinnedCAN, true));
+  Serial.println(F(" us per frame"));
+}
+
+void loop() {
+}
@@ -0,0 +1,63 @@
+#include <CAN_IO.h>
+#include <SPI.h>
+
+// Prints how much RAM each CAN_IO configuration takes, and how much is left on this board,
+// so the receive queue can be sized for each node. Change NODE_RX_DEPTH/NodeFrame to try
+// a configuration, and watch the "free" figure.
+
+//CAN parameters
+const byte     CAN_CS        = 10;
+const byte     CAN_INT       = 2;
+const uint16_t CAN_BAUD_RATE = 500;
+const byte     CAN_FREQ      = 16;    // MUST BE the frequency of the oscillator you use
+
+// This node's configuration
+const int NODE_RX_DEPTH = 8;          // Power of two, up to 128
+typedef Frame NodeFrame;              // Frame, or CompactFrame to save RAM
+
+CAN_IO_T<NODE_RX_DEPTH, NodeFrame> can(CAN_CS, CAN_INT, CAN_BAUD_RATE, CAN_FREQ);
+
+/*
+ * Bytes between the top of the heap and the stack.
+ */
+int freeRAM()
+{
+#if defined(__AVR__)
+  extern int __heap_start, *__brkval;
+  int top;
+  return (int)&top - (__brkval == 0 ? (int)&__heap_start : (int)__brkval);
+#else
+  return -1; // Not measured on this board
+#endif
+}
+
+void report(const __FlashStringHelper* name, unsigned int bytes)
+{
+  Serial.print(name);
+  Serial.print(F(": "));
+  Serial.print(bytes);
+  Serial.println(F(" bytes"));
+}
+
+void setup() {
+  Serial.begin(9600);
+  can.Setup(RX0IE | RX1IE);
+
+  report(F("Frame"), sizeof(Frame));
+  report(F("CompactFrame"), sizeof(CompactFrame));
+  report(F("CAN_IO_T<2>"), sizeof(CAN_IO_T<2>));
+  report(F("CAN_IO (8 frames)"), sizeof(CAN_IO));
+  report(F("CAN_IO_T<64>"), sizeof(CAN_IO_T<64>));
+  report(F("CAN_IO_T<64, CompactFrame>"), sizeof(CAN_IO_T<64, CompactFrame>));
+  report(F("CAN_IO_T<8, Frame, 4, MCP2515_Transport>"), sizeof(CAN_IO_T<8, Frame, 4, MCP2515_Transport>));
+  report(F("This node"), sizeof(can));
+
+  Serial.print(F("Free: "));
+  Serial.println(freeRAM());
+}
+
+void loop() {
+  can.Fetch();
+  while (can.Available())
+    can.Read();
+}
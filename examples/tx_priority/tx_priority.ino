@@ -0,0 +1,97 @@
+#include <CAN_IO.h>
+#include <includes/MCP2515_Sim.h>
+
+// Checks the transmit order of CAN_IO against a simulated MCP2515, so no controller or bus
+// is needed. A burst of telemetry and drive frames is sent with TXBANY, and the order the
+// simulated controller puts them on the bus must match CAN arbitration: lowest ID first,
+// frames with the same ID in the order they were sent.
+// The simulation takes about 2 KB of RAM, so use a board with more than an Uno has.
+
+const uint16_t CAN_BAUD_RATE = 500;
+const byte     CAN_FREQ      = 16;
+
+MCP2515_Sim sim;
+CAN_IO_T<8, Frame, 16> can(sim, CAN_BAUD_RATE, CAN_FREQ);
+
+Frame make(uint32_t id, byte n)
+{
+  Frame f;
+  f.id = id;
+  f.ide = 0;
+  f.rtr = 0;
+  f.srr = 0;
+  f.dlc = 1;
+  f.data[0] = n;
+  return f;
+}
+
+/*
+ * Returns the frame in a TX buffer of the simulated controller (n = 0-2).
+ */
+Frame buffered(byte n)
+{
+  byte raw[13];
+  for (byte i = 0; i < 13; i++)
+    raw[i] = sim.reg(TXB0SIDH + 0x10 * n + i);
+  Frame f;
+  MCP2515::DecodeFrame(raw, f);
+  return f;
+}
+
+/*
+ * Sends the frames, then lets the simulated controller put them on the bus one by one.
+ * Each frame that goes out must be the one that wins arbitration among the pending TX
+ * buffers, and frames with the same ID must keep their order. Returns true if they do.
+ */
+bool check(const uint32_t* ids, byte count) // count <= 16
+{
+  for (byte i = 0; i < count; i++)
+    can.Send(make(ids[i], i), TXBANY); // The first three are loaded, the rest wait in TXbuffer
+
+  bool ok = true;
+  bool done[16] = {}; // Frames sent so far, by position in ids (data[0])
+
+  while (true) {
+    uint32_t best = 0xFFFFFFFF;
+    for (byte n = 0; n < 3; n++) {
+      if ((sim.reg(TXB0CTRL + 0x10 * n) & TXREQ) && buffered(n).id < best)
+        best = buffered(n).id;
+    }
+    if (sim.transmit() < 0)
+      break;
+
+    const Frame& f = sim.sent().frame;
+    Serial.print(f.id, HEX);
+    Serial.print('/');
+    Serial.print(f.data[0]);
+    Serial.print(' ');
+
+    if (f.id != best)
+      ok = false; // A pending frame with a lower ID was passed over
+    for (byte i = 0; i < f.data[0]; i++) {
+      if (ids[i] == f.id && !done[i])
+        ok = false; // Same ID out of order
+    }
+    done[f.data[0]] = true;
+
+    can.Fetch(); // TXnIF: refill the buffer from TXbuffer
+  }
+  Serial.println();
+  return ok;
+}
+
+void setup() {
+  Serial.begin(9600);
+  can.Setup();
+
+  const uint32_t burst[] = {
+    DC_TEMP_0_ID, DC_TEMP_1_ID, DC_STATUS_ID, DC_TEMP_0_ID, DC_DRIVE_ID,
+    DC_INFO_ID, DC_DRIVE_ID, DC_TEMP_1_ID, DC_POWER_ID, DC_HEARTBEAT_ID
+  };
+
+  bool ok = check(burst, sizeof(burst) / sizeof(burst[0]));
+  Serial.println(ok ? F("PASS") : F("FAIL"));
+}
+
+void loop() {
+}
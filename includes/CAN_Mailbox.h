@@ -0,0 +1,222 @@
+/*
+ * CAN_Mailbox.h
+ * Contains definition for the CAN_Mailbox class.
+ */
+
+#ifndef CAN_Mailbox_h
+#define CAN_Mailbox_h
+
+#include <stdint.h>
+#include "MCP2515_defs.h"
+#include "RX_Queue.h"
+
+/*
+ * Returns the table size for N mailboxes: the next power of two at or above 2N,
+ * so that open addressing stays at most half full.
+ */
+constexpr int can_mailbox_table_size(int n, int size = 1)
+{
+	return size >= 2 * n ? size : can_mailbox_table_size(n, size * 2);
+}
+
+/*
+ * Open-addressing table keyed by CAN ID, shared by CAN_Mailbox and CAN_Stats. Slot needs a
+ * uint32_t key and a bool used. Entries are never removed one by one, so a lookup stops at
+ * the first unused slot.
+ */
+template<class Slot>
+class CAN_IDTable {
+public:
+	int size() { return count; }
+
+protected:
+	CAN_IDTable(Slot* table, uint8_t table_size, uint8_t max_ids)
+		: slots(table), table_mask(table_size - 1), capacity(max_ids), count(0) {
+		clear_slots();
+	}
+
+	static uint32_t key(uint32_t id, bool ide) {
+		return ide ? (id | 0x80000000UL) : id;
+	}
+
+	uint8_t hash(uint32_t k) {
+		return (uint8_t)(k ^ (k >> 7) ^ (k >> 14) ^ (k >> 21)) & table_mask;
+	}
+
+	// Returns the slot holding k, or -1.
+	int find(uint32_t k) {
+		uint8_t i = hash(k);
+		for (uint8_t n = 0; n <= table_mask; n++) {
+			if (!slots[i].used)
+				return -1;
+			if (slots[i].key == k)
+				return i;
+			i = (i + 1) & table_mask;
+		}
+		return -1;
+	}
+
+	// Returns the slot holding k. If k is new, claims a free slot for it and sets added, so the
+	// caller can initialize it. Returns -1 if k is new and the table is full.
+	int insert(uint32_t k, bool& added) {
+		added = false;
+		uint8_t i = hash(k);
+		for (uint8_t n = 0; n <= table_mask; n++) {
+			if (!slots[i].used) {
+				if (count >= capacity)
+					return -1;
+				slots[i].key = k;
+				slots[i].used = true;
+				count++;
+				added = true;
+				return i;
+			}
+			if (slots[i].key == k)
+				return i;
+			i = (i + 1) & table_mask;
+		}
+		return -1;
+	}
+
+	void clear_slots() {
+		for (int i = 0; i <= table_mask; i++)
+			slots[i].used = false;
+		count = 0;
+	}
+
+	Slot* slots;
+	uint8_t table_mask;
+	uint8_t capacity;
+	volatile uint8_t count;
+};
+
+/*
+ * One slot of the mailbox table.
+ */
+struct CAN_Slot {
+	uint32_t key;				// ID, with bit 31 set for extended IDs
+	bool used;					// A registered ID lives here
+	volatile bool dirty;		// A frame arrived since the last read()
+	volatile bool received;		// A frame has arrived since add()
+	volatile uint8_t version;	// Odd while store() is writing the frame
+	uint16_t seq;				// Frames received for this ID (wraps)
+	Frame frame;				// Latest frame
+};
+
+/*
+ * Latest-value store for periodic frames, keyed by CAN ID. Each registered ID has one slot;
+ * store() overwrites it in O(1) and read() returns the newest frame, so a burst of periodic
+ * frames can never overflow anything. Use CAN_MailboxTable<N> to get one with storage.
+ *
+ * store() may run in an interrupt (e.g. CAN_IO's auto-fetch). read() copies the frame with
+ * a version check instead of disabling interrupts, and must be called from the main loop.
+ * Register IDs with add() before frames start arriving.
+ */
+class CAN_Mailbox : public CAN_IDTable<CAN_Slot> {
+	/*Usage:
+		- bool	add(id, ide)			 -- Registers an ID. Returns false if the table is full.
+		- bool	contains(id, ide)		 -- Returns true if the ID is registered
+		- bool	store(Frame)			 -- Writes a frame into its ID's slot. Returns false if the ID is not registered.
+		- bool	read(id, Frame&, seq*, ide) -- Copies the latest frame and clears dirty. Returns false if none has arrived.
+		- bool	is_dirty(id, ide)		 -- Returns true if a frame arrived since the last read()
+		*/
+public:
+	/*
+	 * Registers an ID. Adding an ID twice is allowed.
+	 */
+	bool add(uint32_t id, bool ide = false) {
+		bool added;
+		int i = insert(key(id, ide), added);
+		if (i < 0)
+			return false;
+
+		if (added) {
+			slots[i].dirty = false;
+			slots[i].received = false;
+			slots[i].version = 0;
+			slots[i].seq = 0;
+		}
+		return true;
+	}
+
+	bool contains(uint32_t id, bool ide = false) {
+		return find(key(id, ide)) >= 0;
+	}
+
+	/*
+	 * Writes a frame into its slot. Returns false if its ID was not registered, so the caller
+	 * can queue it instead.
+	 */
+	bool store(const Frame& f) {
+		int i = find(key(f.id, f.ide));
+		if (i < 0)
+			return false;
+
+		CAN_Slot& s = slots[i];
+		s.version++;
+		SPSC_BARRIER();
+		s.frame = f;
+		s.seq++;
+		s.received = true;
+		SPSC_BARRIER();
+		s.version++;
+		s.dirty = true;
+		return true;
+	}
+
+	/*
+	 * Copies the latest frame for an ID and clears its dirty flag. If seq is given it gets the
+	 * number of frames received so far (mod 65536), so skipped samples can be spotted.
+	 * Returns false if the ID is not registered or nothing has arrived yet.
+	 */
+	bool read(uint32_t id, Frame& out, uint16_t* seq = 0, bool ide = false) {
+		int i = find(key(id, ide));
+		if (i < 0)
+			return false;
+
+		CAN_Slot& s = slots[i];
+		s.dirty = false; // Cleared first, so a frame arriving during the copy marks it again
+		uint8_t v;
+		uint16_t n;
+		bool got;
+		do {
+			v = s.version;
+			SPSC_BARRIER();
+			out = s.frame;
+			n = s.seq;
+			got = s.received;
+			SPSC_BARRIER();
+		} while ((v & 1) || v != s.version);
+
+		if (seq)
+			*seq = n;
+		return got;
+	}
+
+	bool is_dirty(uint32_t id, bool ide = false) {
+		int i = find(key(id, ide));
+		return i >= 0 && slots[i].dirty;
+	}
+
+protected:
+	CAN_Mailbox(CAN_Slot* table, uint8_t table_size, uint8_t max_ids)
+		: CAN_IDTable<CAN_Slot>(table, table_size, max_ids) {}
+};
+
+/*
+ * Mailbox table with room for N IDs (at most 64).
+ */
+template<int N>
+class CAN_MailboxTable : public CAN_Mailbox {
+	static_assert(N > 0 && N <= 64, "CAN_MailboxTable holds up to 64 IDs");
+
+public:
+	static const int TABLE_SIZE = can_mailbox_table_size(N);
+
+	CAN_MailboxTable() : CAN_Mailbox(table, TABLE_SIZE, N) {}
+
+private:
+	CAN_Slot table[TABLE_SIZE];
+};
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ * CAN_Scheduler.h
+ * Contains definition for the CAN_Scheduler class.
+ */
+
+#ifndef CAN_Scheduler_h
+#define CAN_Scheduler_h
+
+#include <stdint.h>
+#include "MCP2515_defs.h"
+#include "Layouts.h"
+
+#define CAN_AUTO_PHASE	-1		// add(): pick the phase that keeps furthest from the other messages
+#define CAN_SCHED_END	0xFF	// End of the due list
+
+/*
+ * Fills in a frame to send. Return false to skip this period.
+ */
+typedef bool (*FrameProducer)(Frame& frame, void* context);
+
+/*
+ * One periodic message. Times are in microseconds (see CAN_Micros()).
+ */
+struct CAN_Periodic {
+	const Layout* layout;		// Sent as layout->generate_frame(), or
+	FrameProducer producer;		// called to fill in the frame
+	void* context;
+	unsigned long period;
+	unsigned long phase;		// Offset of the first release from the scheduler's start
+	unsigned long due;			// Next release
+	uint8_t next;				// Next entry in due order
+	bool used;
+
+	// Statistics
+	uint32_t count;				// Frames released
+	uint32_t missed;			// Releases skipped because Poll() came a whole period late
+	uint32_t failed;			// Frames Send() could not queue
+	unsigned long max_late;		// Longest delay from the due time to the release
+	unsigned long jitter;		// Running average of that delay (1/16 weight per frame)
+};
+
+/*
+ * Sends Layouts (or frames from a callback) at fixed periods. Release times are kept on a
+ * fixed grid (start + phase + k * period), so late Poll() calls do not make them drift, and
+ * the entries are kept sorted by due time, so a Poll() with nothing due only looks at the first.
+ * Use CAN_SchedulerTable<N> to get one with storage, and attach it with CAN_IO::setScheduler().
+ * Must only be used from the main loop.
+ */
+class CAN_Scheduler {
+	/*Usage:
+		- int	add(layout, period_ms, phase_ms)	 -- Sends layout every period_ms. Returns a handle, or -1 if the table is full.
+		- int	add(producer, context, period_ms, phase_ms) -- Same, with a callback that fills in the frame
+		- void	remove(handle)						 -- Stops sending a message
+		- bool	entry(handle, CAN_Periodic&)		 -- Copies the period, phase and statistics of a message
+		- int	size()								 -- Number of messages
+		- int	next(now, Frame&)					 -- Used by CAN_IO::Poll()
+		*/
+public:
+	/*
+	 * Registers a Layout. It is read when it is due, so its fields can be updated between sends.
+	 * With CAN_AUTO_PHASE the first release is offset to stay as far as possible from the
+	 * releases of the messages already registered.
+	 */
+	int add(const Layout& layout, unsigned long period_ms, long phase_ms = CAN_AUTO_PHASE) {
+		return add(&layout, 0, 0, period_ms, phase_ms);
+	}
+
+	int add(FrameProducer producer, void* context, unsigned long period_ms, long phase_ms = CAN_AUTO_PHASE) {
+		return add(0, producer, context, period_ms, phase_ms);
+	}
+
+	void remove(int handle) {
+		if (!valid(handle))
+			return;
+		unlink(handle);
+		slots[handle].used = false;
+		count--;
+	}
+
+	/*
+	 * Copies a message's entry. Returns false if handle is not a registered message.
+	 */
+	bool entry(int handle, CAN_Periodic& out) {
+		if (!valid(handle))
+			return false;
+		out = slots[handle];
+		return true;
+	}
+
+	int size() { return count; }
+
+	void reset_stats() {
+		for (int i = 0; i < capacity; i++) {
+			slots[i].count = slots[i].missed = slots[i].failed = 0;
+			slots[i].max_late = slots[i].jitter = 0;
+		}
+	}
+
+	/*
+	 * If a message is due at now, fills in frame, moves the message to its next release and
+	 * returns its handle. Returns -1 if nothing is due.
+	 */
+	int next(unsigned long now, Frame& frame) {
+		while (first != CAN_SCHED_END) {
+			uint8_t h = first;
+			CAN_Periodic& e = slots[h];
+			if ((long)(now - e.due) < 0)
+				return -1;
+
+			// Releases that are a whole period late are skipped, not sent in a burst.
+			unsigned long late = now - e.due;
+			if (late >= e.period) {
+				unsigned long skipped = late / e.period;
+				e.missed += skipped;
+				e.due += skipped * e.period;
+				late -= skipped * e.period;
+			}
+
+			e.due += e.period;
+			unlink(h);
+			insert(h);
+
+			if (e.layout)
+				frame = e.layout->generate_frame();
+			else if (!e.producer(frame, e.context))
+				continue;
+
+			e.count++;
+			if (late > e.max_late)
+				e.max_late = late;
+			e.jitter += ((long)late - (long)e.jitter) / 16;
+			return h;
+		}
+		return -1;
+	}
+
+	/*
+	 * Called by CAN_IO::Poll() when a released frame could not be queued.
+	 */
+	void failed(int handle) { slots[handle].failed++; }
+
+protected:
+	CAN_Scheduler(CAN_Periodic* table, uint8_t max)
+		: slots(table), capacity(max), count(0), first(CAN_SCHED_END), started(false) {
+		for (int i = 0; i < capacity; i++)
+			slots[i].used = false;
+	}
+
+private:
+	bool valid(int handle) {
+		return handle >= 0 && handle < capacity && slots[handle].used;
+	}
+
+	int add(const Layout* layout, FrameProducer producer, void* context, unsigned long period_ms, long phase_ms) {
+		if (period_ms == 0)
+			return -1;
+
+		int h = -1;
+		for (int i = 0; i < capacity; i++) {
+			if (!slots[i].used) {
+				h = i;
+				break;
+			}
+		}
+		if (h < 0)
+			return -1;
+
+		unsigned long now = CAN_Micros();
+		if (!started) {
+			start = now;
+			started = true;
+		}
+
+		CAN_Periodic& e = slots[h];
+		e.layout = layout;
+		e.producer = producer;
+		e.context = context;
+		e.period = period_ms * 1000UL;
+		e.phase = (phase_ms < 0) ? stagger(e.period) : ((unsigned long)phase_ms * 1000UL) % e.period;
+		e.count = e.missed = e.failed = 0;
+		e.max_late = e.jitter = 0;
+
+		// First release on the grid that is not in the past
+		e.due = start + e.phase;
+		if ((long)(now - e.due) > 0)
+			e.due += ((now - e.due) / e.period + 1) * e.period;
+
+		e.used = true;
+		count++;
+		insert(h);
+		return h;
+	}
+
+	/*
+	 * Two message streams with periods p and q meet every gcd(p, q), so their closest
+	 * approach is the distance between their phases modulo the gcd. Tries 16 phases across
+	 * the period and returns the one whose closest approach to any registered message is largest.
+	 */
+	unsigned long stagger(unsigned long period) {
+		unsigned long best = 0, best_gap = 0;
+		for (uint8_t k = 0; k < 16; k++) {
+			unsigned long phase = period / 16 * k;
+			unsigned long gap = period;
+			for (int i = 0; i < capacity; i++) {
+				if (!slots[i].used)
+					continue;
+				unsigned long g = gcd(period, slots[i].period);
+				unsigned long d = (phase % g + g - slots[i].phase % g) % g;
+				if (g - d < d)
+					d = g - d;
+				if (d < gap)
+					gap = d;
+			}
+			if (gap > best_gap) {
+				best_gap = gap;
+				best = phase;
+			}
+		}
+		return best;
+	}
+
+	static unsigned long gcd(unsigned long a, unsigned long b) {
+		while (b) {
+			unsigned long t = a % b;
+			a = b;
+			b = t;
+		}
+		return a;
+	}
+
+	// Puts entry h in the due list, after the entries due at the same time.
+	void insert(uint8_t h) {
+		uint8_t* link = &first;
+		while (*link != CAN_SCHED_END && (long)(slots[*link].due - slots[h].due) <= 0)
+			link = &slots[*link].next;
+		slots[h].next = *link;
+		*link = h;
+	}
+
+	void unlink(uint8_t h) {
+		uint8_t* link = &first;
+		while (*link != CAN_SCHED_END && *link != h)
+			link = &slots[*link].next;
+		if (*link == h)
+			*link = slots[h].next;
+	}
+
+	CAN_Periodic* slots;
+	uint8_t capacity;
+	uint8_t count;
+	uint8_t first;			// Entry due soonest
+	bool started;
+	unsigned long start;	// Time of the first add(); phases count from here
+};
+
+/*
+ * Scheduler with room for N messages (at most 254).
+ */
+template<int N>
+class CAN_SchedulerTable : public CAN_Scheduler {
+	static_assert(N > 0 && N < CAN_SCHED_END, "CAN_SchedulerTable holds up to 254 messages");
+
+public:
+	CAN_SchedulerTable() : CAN_Scheduler(table, N) {}
+
+private:
+	CAN_Periodic table[N];
+};
+
+#endif
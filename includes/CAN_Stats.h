@@ -0,0 +1,151 @@
+/*
+ * CAN_Stats.h
+ * Contains definition for the CAN_Stats class.
+ */
+
+#ifndef CAN_Stats_h
+#define CAN_Stats_h
+
+#include <stdint.h>
+#include "MCP2515_defs.h"
+#include "RX_Queue.h"
+#include "CAN_Mailbox.h"
+
+/*
+ * Arrival statistics for one ID. Times are in microseconds (see CAN_Micros()).
+ */
+struct CAN_ArrivalStats {
+	uint32_t key;					// ID, with bit 31 set for extended IDs
+	bool used;
+	volatile uint8_t version;		// Odd while record() is writing
+	uint32_t count;					// Frames received
+	unsigned long last;				// Timestamp of the latest frame
+	unsigned long min_interval;		// Shortest gap between two frames
+	unsigned long max_interval;		// Longest gap between two frames
+	unsigned long mean_interval;	// Running average of the gap (1/16 weight per frame)
+	unsigned long jitter;			// Running average of |gap - mean_interval|, as in RFC 3550
+};
+
+/*
+ * Per-ID arrival statistics, built from the timestamps Fetch() puts on each frame. IDs are
+ * added the first time they are seen, until the table is full; later IDs are counted in
+ * untracked(). Use CAN_StatsTable<N> to get one with storage.
+ *
+ * record() may run in an interrupt. get() copies with a version check instead of disabling
+ * interrupts, and must be called from the main loop.
+ */
+class CAN_Stats : public CAN_IDTable<CAN_ArrivalStats> {
+	/*Usage:
+		- void	record(Frame)			 -- Adds a frame's timestamp to its ID's statistics
+		- bool	get(id, stats&, ide)	 -- Copies the statistics for an ID. Returns false if it has not been seen.
+		- unsigned long age(id, now, ide) -- Time since the ID last arrived (0 if never seen)
+		- int	size()					 -- Number of IDs tracked
+		- int	entry(n, stats&)		 -- Copies the nth tracked ID's statistics, for listing them all
+		*/
+public:
+	void record(const Frame& f) {
+		bool added;
+		int i = insert(key(f.id, f.ide), added);
+		if (i < 0) {
+			untracked_count++;
+			return;
+		}
+
+		CAN_ArrivalStats& s = slots[i];
+		if (added) {
+			s.version = 0;
+			s.count = 0;
+			s.jitter = 0;
+		}
+		s.version++;
+		SPSC_BARRIER();
+		if (s.count > 0) {
+			unsigned long gap = f.timestamp - s.last;
+			if (s.count == 1) {
+				s.min_interval = s.max_interval = s.mean_interval = gap;
+			}
+			else {
+				if (gap < s.min_interval) s.min_interval = gap;
+				if (gap > s.max_interval) s.max_interval = gap;
+				long d = (long)(gap - s.mean_interval);
+				s.mean_interval += d / 16;
+				if (d < 0) d = -d;
+				s.jitter += ((long)d - (long)s.jitter) / 16;
+			}
+		}
+		s.last = f.timestamp;
+		s.count++;
+		SPSC_BARRIER();
+		s.version++;
+	}
+
+	bool get(uint32_t id, CAN_ArrivalStats& out, bool ide = false) {
+		int i = find(key(id, ide));
+		if (i < 0)
+			return false;
+		copy(slots[i], out);
+		return true;
+	}
+
+	unsigned long age(uint32_t id, unsigned long now, bool ide = false) {
+		CAN_ArrivalStats s;
+		if (!get(id, s, ide))
+			return 0;
+		return now - s.last;
+	}
+
+	uint32_t untracked() { return untracked_count; }
+
+	/*
+	 * Copies the statistics of the nth tracked ID (0 <= n < size()). The ID is in out.key.
+	 */
+	bool entry(int n, CAN_ArrivalStats& out) {
+		for (int i = 0; i <= table_mask; i++) {
+			if (slots[i].used && n-- == 0) {
+				copy(slots[i], out);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void clear() {
+		clear_slots();
+		untracked_count = 0;
+	}
+
+protected:
+	CAN_Stats(CAN_ArrivalStats* table, uint8_t table_size, uint8_t max_ids)
+		: CAN_IDTable<CAN_ArrivalStats>(table, table_size, max_ids), untracked_count(0) {}
+
+private:
+	void copy(CAN_ArrivalStats& s, CAN_ArrivalStats& out) {
+		uint8_t v;
+		do {
+			v = s.version;
+			SPSC_BARRIER();
+			out = s;
+			SPSC_BARRIER();
+		} while ((v & 1) || v != s.version);
+	}
+
+	volatile uint32_t untracked_count;
+};
+
+/*
+ * Statistics table for up to N IDs (at most 64).
+ */
+template<int N>
+class CAN_StatsTable : public CAN_Stats {
+	static_assert(N > 0 && N <= 64, "CAN_StatsTable holds up to 64 IDs");
+
+public:
+	static const int TABLE_SIZE = can_mailbox_table_size(N);
+
+	CAN_StatsTable() : CAN_Stats(table, TABLE_SIZE, N) {}
+
+private:
+	CAN_ArrivalStats table[TABLE_SIZE];
+};
+
+#endif
@@ -111,11 +111,20 @@ public:
 		return generate_frame().toString();
 	}
 
+	/*
+	 * Writes this layout straight into a TX buffer image, for CAN_IO::SendDirect().
+	 * Not virtual: layouts sent often hide it with their own, which fills in the image
+	 * without building a Frame. Others go through generate_frame(). A subclass that
+	 * overrides generate_frame() must also hide encode() if its parent has one.
+	 */
+	void encode(MCP2515_TXImage &image) const;
+
 protected:
 	/*
 	 * Fill out the header info for a frame.
 	 */
 	inline void set_header(Frame &f, byte size = 8) const;
+	inline void set_header(MCP2515_TXImage &image, byte size = 8) const;
 };
 
 /*
@@ -127,6 +136,7 @@ class TRI88_Drive : public Layout
     TRI88_Drive(float v, float c) : velocity(v), current(c) {id = TRI88_DRIVE_ID;}
     TRI88_Drive(const Frame &frame) : velocity(frame.low_f), current(frame.high_f) { id = frame.id; }
     Frame generate_frame() const;
+    void encode(MCP2515_TXImage &image) const;
 
   	uint32_t velocity;
   	uint32_t current;
@@ -138,6 +148,7 @@ class TRI88_Power : public Layout
     TRI88_Power(float bc) : bus_current(bc) {id = TRI88_POWER_ID;}
     TRI88_Power(const Frame &frame) : bus_current(frame.high_f) { id = frame.id; }
     Frame generate_frame() const;
+    void encode(MCP2515_TXImage &image) const;
 
     uint32_t bus_current;
 };
@@ -149,6 +160,7 @@ public:
 	TRI88_Reset(const Frame &frame) { id = frame.id; }
 
 	Frame generate_frame() const;
+	void encode(MCP2515_TXImage &image) const;
 };
 
 class TRI88_Status : public Layout
@@ -216,6 +228,7 @@ public:
 	}
 
 	Frame generate_frame() const;
+	void encode(MCP2515_TXImage &image) const;
 
 	uint16_t voltage;
 	uint16_t current;
@@ -16,18 +16,32 @@
 
 #include "Arduino.h"
 #include "MCP2515_defs.h"
+#include "MCP2515_Transport.h"
+#include "MCP2515_Timing.h"
 
 String frameToString(const Frame&);
 
+// Results of RequestMode()/PollMode()
+#define MODE_REQUEST_DONE     0x00 // Controller is in the requested mode
+#define MODE_REQUEST_PENDING  0x01 // Still waiting for CANSTAT to match
+#define MODE_REQUEST_TIMEOUT  0x02 // Deadline passed before CANSTAT matched
+
+// Called when a mode request finishes. success is false if it timed out.
+typedef void (*ModeCallback)(byte mode, bool success);
+
 class MCP2515
 {
   public:
-      // Constructor defining which pins to use for CS and INT
-    MCP2515(byte CS_Pin, byte INT_Pin);
+      // Constructor taking the transport to use (MCP2515_SPIDriver owns an MCP2515_SPI for given pins)
+    MCP2515(MCP2515_Transport& transport);
+
+      // Starts the transport (configures SPI)
+      void Begin();
       
       // Overloaded initialization function
       int Init(int baud, byte freq);
       int Init(int baud, byte freq, byte sjw);
+      bool Init(const MCP2515_Timing& timing); // e.g. Init(MCP2515_BitTiming<500, 16>::value)
       
       // Basic MCP2515 SPI Command Set
     void Reset();
@@ -37,7 +51,8 @@ class MCP2515
       Frame ReadBuffer(byte buffer);
       void Write(byte address, byte data);
       void Write(byte address, byte data[], byte bytes);
-      bool LoadBuffer(byte buffer, Frame message, bool verify = false);
+      bool LoadBuffer(byte buffer, const Frame& message, bool verify = false);
+      void LoadImage(byte buffer, MCP2515_TXImage& image); // Clocks out an encoded buffer as is (see Layout::encode())
       void SendBuffer(byte buffers);
       byte Status();
       byte RXStatus();
@@ -47,14 +62,63 @@ class MCP2515
       bool Interrupt(); // Expose state of INT pin
       byte GetInterrupt(); // Returns CANINTF Register
       bool ResetInterrupt(byte intSelect); // Resets the interrupt flags specified (use ORed combination of CANINTF flags)
-      bool Mode(byte mode); // Returns TRUE if mode change successful
+      bool Mode(byte mode, unsigned int timeout = 10); // Returns TRUE if mode change successful. Blocks until CANSTAT matches or timeout ms pass.
       bool AbortTransmissions(byte timeout = 10); // Aborts any pending transmissions (may experience slight delay due to SPI). Returns false if it times out after timeout ms.
+
+      // Hardware pins. rts is the ORed TXBn buffers whose TXnRTS pin starts them (SendBuffer() then
+      // pulses the pin instead of sending RTS over SPI). bf is RX0IF and/or RX1IF for RXnBF pins that
+      // go low while the buffer is full. Both take effect at the next Init().
+      void SetPinModes(byte rts, byte bf);
+      byte BufferFull(); // Returns RX0IF/RX1IF for the full RX buffers, from the RXnBF pins if they are set up
+      bool BufferPins() { return _bfPins == (RX0IF | RX1IF); } // True if both RXnBF pins are full flags
+
+      // Non-blocking mode changes
+      byte RequestMode(byte mode, unsigned int timeout = 10, ModeCallback callback = 0); // Requests a mode and checks CANSTAT once
+      byte PollMode(); // Checks CANSTAT for a pending request. Returns one of the MODE_REQUEST_ values.
+      bool ModePending() { return _modeStatus == MODE_REQUEST_PENDING; }
+
+      // Buffer encoding, shared with code that talks to the MCP2515 without this class
+      static void EncodeHeader(const Frame& message, byte header[5]); // Fills TXBnSIDH..TXBnDLC
+      static void EncodeHeader(unsigned long id, bool ide, bool rtr, byte dlc, byte header[5]);
+      static void DecodeFrame(const byte raw[13], Frame& message); // From RXBnSIDH..RXBnD7
+      void InvalidateTXHeaders(); // Call after loading TX buffers without LoadBuffer() or LoadImage()
       
   private:
       bool _init(int baud, byte freq, byte sjw, bool autoBaud);
-    // Pin variables
-      byte _CS;
-      byte _INT;
+      bool _timing(int baud, byte freq, byte sjw, MCP2515_Timing& timing);
+      bool _configure(const MCP2515_Timing& timing, bool listenOnly);
+      int _autoBaud(byte freq, byte sjw);
+    // Transport variables
+      MCP2515_Transport* _spi;
+    // Last header written to each TX buffer, so repeated IDs only reload the payload
+      byte _txHeader[3][5];
+      byte _txHeaderValid; // bit n set if _txHeader[n] matches TXBn
+    // Pending mode request
+      byte _modeTarget;
+      byte _modeStatus;
+      unsigned long _modeStart;
+      unsigned int _modeTimeout;
+      ModeCallback _modeCallback;
+    // Rate found by auto-baud (0 if none yet)
+      int _autoBaudRate;
+    // TXRTSCTRL and BFPCTRL pin modes (see SetPinModes())
+      byte _rtsPins;
+      byte _bfPins;
+
+};
+
+// Holds the MCP2515_SPI of an MCP2515_SPIDriver, so it is constructed before the MCP2515 base
+struct MCP2515_SPIMember
+{
+    MCP2515_SPIMember(byte CS_Pin, byte INT_Pin) : _pins(CS_Pin, INT_Pin) {}
+      MCP2515_SPI _pins;
+};
+
+// MCP2515 driving the Arduino SPI library, with the given pins for CS and INT
+class MCP2515_SPIDriver : private MCP2515_SPIMember, public MCP2515
+{
+  public:
+    MCP2515_SPIDriver(byte CS_Pin, byte INT_Pin) : MCP2515_SPIMember(CS_Pin, INT_Pin), MCP2515(_pins) {}
 };
 
 #endif
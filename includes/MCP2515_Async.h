@@ -0,0 +1,364 @@
+/*
+ * MCP2515_Async.h
+ * Queue of MCP2515 commands that run in the background and report back through callbacks.
+ */
+
+#ifndef MCP2515_Async_h
+#define MCP2515_Async_h
+
+#include <stdint.h>
+#include <string.h>
+#include "Arduino.h"
+#include "MCP2515.h"
+#include "MCP2515_defs.h"
+#include "MCP2515_Transport.h"
+
+// Kinds of request
+#define ASYNC_READ          0x01 // Sequential register read
+#define ASYNC_READ_BUFFER   0x02 // READ RX BUFFER (clears RXnIF when done)
+#define ASYNC_LOAD_BUFFER   0x03 // LOAD TX BUFFER
+
+/*
+ * Masks interrupts for its lifetime. On AVR it restores the previous state, so it is safe
+ * to use from inside an ISR.
+ */
+struct MCP2515_AsyncLock
+{
+#if defined(__AVR__)
+	MCP2515_AsyncLock() : sreg(SREG) { cli(); }
+	~MCP2515_AsyncLock() { SREG = sreg; }
+	uint8_t sreg;
+#else
+	MCP2515_AsyncLock() { noInterrupts(); }
+	~MCP2515_AsyncLock() { interrupts(); }
+#endif
+};
+
+struct MCP2515_Request;
+
+// Called when a request finishes. With an interrupt-driven engine this runs inside the ISR.
+typedef void (*RequestCallback)(MCP2515_Request& request, void* context);
+
+/*
+ * One queued SPI transaction. data holds the command on the way out and the answer on the way back.
+ */
+struct MCP2515_Request
+{
+	byte type;
+	byte length; // bytes clocked
+	byte data[MCP2515_MAX_TRANSFER];
+	RequestCallback callback;
+	void* context;
+
+	/*
+	 * Returns the bytes read back (registers for ASYNC_READ, RXBnSIDH..RXBnD7 for ASYNC_READ_BUFFER).
+	 */
+	const byte* result() const { return data + (type == ASYNC_READ ? 2 : 1); }
+
+	/*
+	 * Decodes the frame read by an ASYNC_READ_BUFFER request.
+	 */
+	Frame frame() const
+	{
+		Frame f;
+		MCP2515::DecodeFrame(result(), f);
+		return f;
+	}
+};
+
+class MCP2515_AsyncQueue;
+
+/*
+ * Runs one transaction at a time for the queue. start() clocks n bytes of buf in place and
+ * returns; when the transfer is over the engine calls finished(). It may do so from inside
+ * start() (blocking engines) or later from an ISR or poll().
+ */
+class MCP2515_AsyncEngine
+{
+public:
+	MCP2515_AsyncEngine() : queue(0) {}
+
+	virtual void start(byte* buf, byte n) = 0;
+
+	/*
+	 * Moves a polled engine along. Interrupt-driven engines don't need it.
+	 */
+	virtual void poll() {}
+
+	void attach(MCP2515_AsyncQueue* q) { queue = q; }
+
+protected:
+	inline void finished();
+
+private:
+	MCP2515_AsyncQueue* queue;
+};
+
+/*
+ * Base of the request queue. Use MCP2515_Async<Depth> to get one with storage.
+ */
+class MCP2515_AsyncQueue
+{
+public:
+	/*
+	 * Posts a sequential read of bytes registers starting at address (at most MCP2515_MAX_TRANSFER - 2).
+	 */
+	bool PostRead(byte address, byte bytes, RequestCallback callback, void* context = 0)
+	{
+		if (bytes > MCP2515_MAX_TRANSFER - 2) return false;
+		MCP2515_Request* r = reserve(ASYNC_READ, 2 + bytes, callback, context);
+		if (!r) return false;
+		r->data[0] = CAN_READ;
+		r->data[1] = address;
+		return post();
+	}
+
+	/*
+	 * Posts a read of a whole RX buffer (RXB0 or RXB1). Use request.frame() in the callback.
+	 */
+	bool PostReadBuffer(byte buffer, RequestCallback callback, void* context = 0)
+	{
+		MCP2515_Request* r = reserve(ASYNC_READ_BUFFER, 14, callback, context);
+		if (!r) return false;
+		r->data[0] = CAN_READ_BUFFER | (buffer << 1);
+		return post();
+	}
+
+	/*
+	 * Posts a load of a TX buffer (TXB0, TXB1 or TXB2). The frame is copied, so it can be reused at once.
+	 */
+	bool PostLoadBuffer(byte buffer, const Frame& message, RequestCallback callback = 0, void* context = 0)
+	{
+		byte dlc = (message.dlc > 8) ? 8 : message.dlc;
+		MCP2515_Request* r = reserve(ASYNC_LOAD_BUFFER, 6 + dlc, callback, context);
+		if (!r) return false;
+		if (buffer == TXB0) buffer = 0;
+		r->data[0] = CAN_LOAD_BUFFER | buffer;
+		MCP2515::EncodeHeader(message, r->data + 1);
+		memcpy(r->data + 6, message.data, dlc);
+		// The driver's header cache no longer matches what is in the buffer.
+		if (controller) controller->InvalidateTXHeaders();
+		return post();
+	}
+
+	/*
+	 * Lets a polled engine make progress.
+	 */
+	void Poll() { engine->poll(); }
+
+	/*
+	 * True while requests are queued or running. Don't use the synchronous driver on the
+	 * same SPI bus until this is false.
+	 */
+	bool Busy() const { return count > 0; }
+	byte Pending() const { return count; }
+
+	/*
+	 * Called by the engine when the running transaction is over.
+	 */
+	void finished()
+	{
+		MCP2515_Request& r = requests[tail];
+		running = false;
+		if (r.callback) r.callback(r, r.context);
+
+		{
+			MCP2515_AsyncLock lock;
+			tail = (tail + 1) % depth;
+			count--;
+		}
+
+		if (!starting) kick();
+	}
+
+protected:
+	MCP2515_AsyncQueue(MCP2515_Request* storage, byte size, MCP2515_AsyncEngine& e, MCP2515* c)
+		: requests(storage), depth(size), head(0), tail(0), count(0), running(false), starting(false),
+		  engine(&e), controller(c)
+	{
+		engine->attach(this);
+	}
+
+private:
+	MCP2515_Request* reserve(byte type, byte length, RequestCallback callback, void* context)
+	{
+		if (count >= depth) return 0;
+		MCP2515_Request* r = &requests[head];
+		r->type = type;
+		r->length = length;
+		r->callback = callback;
+		r->context = context;
+		memset(r->data, 0, length);
+		return r;
+	}
+
+	bool post()
+	{
+		{
+			MCP2515_AsyncLock lock;
+			head = (head + 1) % depth;
+			count++;
+		}
+		kick();
+		return true;
+	}
+
+	/*
+	 * Starts the oldest request if the engine is idle. Blocking engines finish inside start(),
+	 * so this loops instead of recursing through finished().
+	 */
+	void kick()
+	{
+		while (true)
+		{
+			{
+				MCP2515_AsyncLock lock;
+				if (running || count == 0) return;
+				running = true;
+				starting = true;
+			}
+			engine->start(requests[tail].data, requests[tail].length);
+			starting = false;
+		}
+	}
+
+	MCP2515_Request* requests;
+	byte depth;
+	volatile byte head;
+	volatile byte tail;
+	volatile byte count;
+	volatile bool running;
+	volatile bool starting;
+	MCP2515_AsyncEngine* engine;
+	MCP2515* controller;
+};
+
+inline void MCP2515_AsyncEngine::finished()
+{
+	if (queue) queue->finished();
+}
+
+/*
+ * Request queue holding up to Depth requests.
+ *   MCP2515_BlockingEngine engine(transport);
+ *   MCP2515_Async<4> async(engine, &can.controller);
+ * controller is optional; if given, its TX header cache is cleared by PostLoadBuffer().
+ */
+template <int Depth>
+class MCP2515_Async : public MCP2515_AsyncQueue
+{
+public:
+	MCP2515_Async(MCP2515_AsyncEngine& engine, MCP2515* controller = 0)
+		: MCP2515_AsyncQueue(storage, Depth, engine, controller) {}
+
+private:
+	MCP2515_Request storage[Depth];
+};
+
+/*
+ * Engine that runs each transaction straight away on a transport. Works everywhere, but
+ * gives no overlap; use it where no faster engine exists.
+ */
+class MCP2515_BlockingEngine : public MCP2515_AsyncEngine
+{
+public:
+	MCP2515_BlockingEngine(MCP2515_Transport& t) : transport(&t) {}
+
+	void start(byte* buf, byte n)
+	{
+		transport->transfer(buf, buf, n);
+		finished();
+	}
+
+private:
+	MCP2515_Transport* transport;
+};
+
+/*
+ * Deterministic engine for tests without hardware. Each transaction takes ticks_per_byte
+ * calls to poll() per byte, then runs on the transport (e.g. MCP2515_Recorder) and finishes.
+ */
+class MCP2515_SimEngine : public MCP2515_AsyncEngine
+{
+public:
+	MCP2515_SimEngine(MCP2515_Transport& t, unsigned int ticks = 1)
+		: ticks_per_byte(ticks), transport(&t), buf(0), n(0), remaining(0), ticks_total(0) {}
+
+	void start(byte* b, byte length)
+	{
+		buf = b;
+		n = length;
+		remaining = (unsigned long)length * ticks_per_byte;
+	}
+
+	void poll()
+	{
+		ticks_total++;
+		if (!buf) return;
+		if (remaining > 0 && --remaining > 0) return;
+
+		byte* done = buf;
+		buf = 0;
+		transport->transfer(done, done, n);
+		finished();
+	}
+
+	unsigned int ticks_per_byte;
+	unsigned long ticks() const { return ticks_total; } // poll() calls so far
+
+private:
+	MCP2515_Transport* transport;
+	byte* buf;
+	byte n;
+	unsigned long remaining;
+	unsigned long ticks_total;
+};
+
+#if defined(__AVR__)
+#include "MCP2515_Pinned.h"
+
+/*
+ * Interrupt-driven engine for AVR. Each byte is shifted by the SPI transfer-complete interrupt,
+ * so the main loop keeps running while a transaction is in progress. The sketch must forward
+ * the interrupt:
+ *   MCP2515_AVRSPIEngine<10> engine;
+ *   ISR(SPI_STC_vect) { engine.isr(); }
+ * SPI must already be set up (e.g. by CAN_IO::Setup()).
+ */
+template <byte CS_Pin>
+class MCP2515_AVRSPIEngine : public MCP2515_AsyncEngine
+{
+public:
+	MCP2515_AVRSPIEngine() : buf(0), n(0), i(0) {}
+
+	void start(byte* b, byte length)
+	{
+		buf = b;
+		n = length;
+		i = 0;
+		MCP2515_FastPin<CS_Pin>::low();
+		SPCR |= _BV(SPIE);
+		SPDR = buf[0];
+	}
+
+	void isr()
+	{
+		buf[i++] = SPDR;
+		if (i < n)
+		{
+			SPDR = buf[i];
+			return;
+		}
+		MCP2515_FastPin<CS_Pin>::high();
+		SPCR &= ~_BV(SPIE);
+		finished();
+	}
+
+private:
+	byte* volatile buf;
+	volatile byte n;
+	volatile byte i;
+};
+#endif
+
+#endif
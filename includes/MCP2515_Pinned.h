@@ -0,0 +1,115 @@
+/*
+ * MCP2515_Pinned.h
+ * MCP2515 transport and driver with the CS and INT pins fixed at compile time.
+ */
+
+#ifndef MCP2515_Pinned_h
+#define MCP2515_Pinned_h
+
+#include <stdint.h>
+#include "Arduino.h"
+#include "SPI.h"
+#include "MCP2515.h"
+#include "MCP2515_Transport.h"
+
+/*
+ * Pin access resolved at compile time.
+ * On the ATmega328P/168 (Uno, Nano, Pro Mini) the port register and bit mask are constants, so
+ * high()/low() compile to a single sbi/cbi instruction. Teensy uses digitalWriteFast(), which does
+ * the same with a constant pin. Other boards fall back to digitalWrite()/digitalRead().
+ */
+template <byte Pin>
+struct MCP2515_FastPin
+{
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__) || defined(__AVR_ATmega168__)
+	static_assert(Pin < 20, "Pin is not a digital pin on this board");
+
+	static const uint8_t mask = 1 << (Pin < 8 ? Pin : (Pin < 14 ? Pin - 8 : Pin - 14));
+
+	static inline volatile uint8_t& port() { return Pin < 8 ? PORTD : (Pin < 14 ? PORTB : PORTC); }
+	static inline volatile uint8_t& ddr() { return Pin < 8 ? DDRD : (Pin < 14 ? DDRB : DDRC); }
+	static inline volatile uint8_t& in() { return Pin < 8 ? PIND : (Pin < 14 ? PINB : PINC); }
+
+	static inline void output() { ddr() |= mask; }
+	static inline void input_pullup() { ddr() &= ~mask; port() |= mask; }
+	static inline void high() { port() |= mask; }
+	static inline void low() { port() &= ~mask; }
+	static inline bool read() { return in() & mask; }
+#elif defined(CORE_TEENSY)
+	static inline void output() { pinMode(Pin, OUTPUT); }
+	static inline void input_pullup() { pinMode(Pin, INPUT_PULLUP); }
+	static inline void high() { digitalWriteFast(Pin, HIGH); }
+	static inline void low() { digitalWriteFast(Pin, LOW); }
+	static inline bool read() { return digitalReadFast(Pin); }
+#else
+	static inline void output() { pinMode(Pin, OUTPUT); }
+	static inline void input_pullup() { pinMode(Pin, INPUT_PULLUP); }
+	static inline void high() { digitalWrite(Pin, HIGH); }
+	static inline void low() { digitalWrite(Pin, LOW); }
+	static inline bool read() { return digitalRead(Pin) == HIGH; }
+#endif
+};
+
+/*
+ * SPI transport with compile-time CS and INT pins. Can be passed to the CAN_IO constructor:
+ *   MCP2515_PinnedSPI<10, 2> pins;
+ *   CAN_IO can(pins, 500, 16, 2);
+ */
+template <byte CS_Pin, byte INT_Pin>
+class MCP2515_PinnedSPI : public MCP2515_Transport
+{
+public:
+	MCP2515_PinnedSPI()
+	{
+		MCP2515_FastPin<CS_Pin>::output();
+		MCP2515_FastPin<CS_Pin>::high();
+		MCP2515_FastPin<INT_Pin>::input_pullup();
+	}
+
+	void begin()
+	{
+		SPI.setClockDivider(10);
+		SPI.setDataMode(SPI_MODE0);
+		SPI.setBitOrder(MSBFIRST);
+		SPI.begin();
+	}
+
+	void transfer(const byte* tx, byte* rx, byte n)
+	{
+		// SPI.transfer(buf, n) works in place, so copy the command into the receive buffer first.
+		byte scratch[MCP2515_MAX_TRANSFER];
+		if (!rx) rx = scratch;
+		if (rx != tx) memcpy(rx, tx, n);
+
+		MCP2515_FastPin<CS_Pin>::low();
+		SPI.transfer(rx, n);
+		MCP2515_FastPin<CS_Pin>::high();
+	}
+
+	bool interrupt()
+	{
+		return !MCP2515_FastPin<INT_Pin>::read();
+	}
+};
+
+/*
+ * Holds the transport of an MCP2515_Pinned.
+ */
+template <byte CS_Pin, byte INT_Pin>
+struct MCP2515_PinnedMember
+{
+	MCP2515_PinnedSPI<CS_Pin, INT_Pin> _transport;
+};
+
+/*
+ * MCP2515 driver with compile-time pins. Works like MCP2515_SPIDriver(CS_Pin, INT_Pin).
+ * The transport is in a base listed before MCP2515, so it is constructed first.
+ */
+template <byte CS_Pin, byte INT_Pin>
+class MCP2515_Pinned : private MCP2515_PinnedMember<CS_Pin, INT_Pin>, public MCP2515
+{
+public:
+	MCP2515_Pinned() : MCP2515(this->_transport) {}
+};
+
+#endif
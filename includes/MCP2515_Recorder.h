@@ -0,0 +1,75 @@
+/*
+ * MCP2515_Recorder.h
+ * Transport that records SPI transactions instead of driving hardware.
+ */
+
+#ifndef MCP2515_Recorder_h
+#define MCP2515_Recorder_h
+
+#include <string.h>
+#include "MCP2515_Transport.h"
+
+/*
+ * Records every transaction the driver makes, so its SPI traffic can be counted without a
+ * controller attached. The last LOG_SIZE transactions are kept, and the totals count every byte.
+ * By default the device answers with zeros; override respond() to simulate a controller.
+ */
+class MCP2515_Recorder : public MCP2515_Transport
+{
+  public:
+    static const int LOG_SIZE = 64;
+
+    struct Transaction {
+      byte length;
+      byte tx[MCP2515_MAX_TRANSFER];
+    };
+
+    MCP2515_Recorder() : transactions(0), bytes(0), int_line(false) {}
+
+    void transfer(const byte* tx, byte* rx, byte n)
+    {
+      // Copy the command first, since rx may overlap tx.
+      Transaction& t = log[transactions % LOG_SIZE];
+      t.length = n;
+      memcpy(t.tx, tx, n);
+      transactions++;
+      bytes += n;
+
+      byte scratch[MCP2515_MAX_TRANSFER];
+      respond(t.tx, rx ? rx : scratch, n);
+    }
+
+    bool interrupt() { return int_line; }
+
+    /*
+     * Returns a recorded transaction. back = 0 is the most recent one.
+     */
+    const Transaction& last(unsigned long back = 0) const
+    {
+      return log[(transactions - 1 - back) % LOG_SIZE];
+    }
+
+    /*
+     * Clears the counters.
+     */
+    void clear() { transactions = 0; bytes = 0; }
+
+    unsigned long transactions; // Number of transactions since clear()
+    unsigned long bytes;        // Number of bytes clocked since clear()
+    bool int_line;              // State reported by interrupt()
+
+  protected:
+    /*
+     * Fills rx with the device's answer to the command in tx.
+     */
+    virtual void respond(const byte* tx, byte* rx, byte n)
+    {
+      (void)tx;
+      memset(rx, 0, n);
+    }
+
+  private:
+    Transaction log[LOG_SIZE];
+};
+
+#endif
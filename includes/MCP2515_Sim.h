@@ -0,0 +1,257 @@
+/*
+ * MCP2515_Sim.h
+ * Register-level simulation of an MCP2515, for running the driver without hardware.
+ */
+
+#ifndef MCP2515_Sim_h
+#define MCP2515_Sim_h
+
+#include <string.h>
+#include "MCP2515.h"
+#include "MCP2515_defs.h"
+#include "MCP2515_Recorder.h"
+
+/*
+ * Answers the SPI command set from a 128 byte register file, and models the INT, TXnRTS
+ * and RXnBF lines. Nothing happens on the bus by itself:
+ *   receive() puts a frame into an RX buffer, as if it had been accepted from the bus.
+ *   transmit() sends the highest priority pending TX buffer and logs it in sent().
+ *   pulseRTS() drives the TXnRTS pins low and high again.
+ * Mode changes take effect at once. Filters, bit timing and bus errors are not modelled.
+ * In loopback mode transmitted frames are received again.
+ */
+class MCP2515_Sim : public MCP2515_Recorder
+{
+  public:
+    static const int SENT_LOG = 16;
+
+    struct Sent {
+      Frame frame;
+      byte buffer; // 0-2
+    };
+
+    MCP2515_Sim() : sent_count(0), rts_pulses(0) { reset(); }
+
+    /*
+     * Puts a frame into RXB0 (rolling over to RXB1 if BUKT is set) or RXB1.
+     * Returns false and sets the overflow flag if the buffer is still full.
+     */
+    bool receive(const Frame& message, byte buffer = RXB0)
+    {
+      byte mode = regs[CANSTAT] & MODE_MASK;
+      if (mode == MODE_CONFIG || mode == MODE_SLEEP) return false;
+
+      byte n = (buffer == RXB1) ? 1 : 0;
+      if (n == 0 && (regs[CANINTF] & RX0IF) && (regs[RXB0CTRL] & 0x04)) n = 1; // BUKT rollover
+
+      byte flag = n ? RX1IF : RX0IF;
+      if (regs[CANINTF] & flag) {
+        regs[EFLG] |= n ? 0x80 : 0x40; // RXnOVR
+        regs[CANINTF] |= ERRIF;
+        update();
+        return false;
+      }
+
+      byte* raw = regs + (n ? RXB1CTRL : RXB0CTRL) + 1;
+      MCP2515::EncodeHeader(message, raw);
+      if (message.rtr) raw[4] = (message.dlc & 0x0F) | 0x40;
+      memcpy(raw + 5, message.data, 8);
+      regs[CANINTF] |= flag;
+      update();
+      return true;
+    }
+
+    /*
+     * Sends the pending TX buffer that would win on the bus (highest TXP, then highest buffer
+     * number) and returns its number, or -1 if none can go out in the current mode.
+     */
+    int transmit()
+    {
+      byte mode = regs[CANSTAT] & MODE_MASK;
+      if (mode != MODE_NORMAL && mode != MODE_LOOPBACK) return -1;
+
+      int best = -1;
+      for (int n = 2; n >= 0; n--) {
+        byte ctrl = regs[TXB0CTRL + 0x10 * n];
+        if (!(ctrl & TXREQ)) continue;
+        if (best < 0 || (ctrl & TXP_MASK) > (regs[TXB0CTRL + 0x10 * best] & TXP_MASK)) best = n;
+      }
+      if (best < 0) return -1;
+
+      Sent& s = log_sent[sent_count % SENT_LOG];
+      s.buffer = best;
+      MCP2515::DecodeFrame(regs + TXB0SIDH + 0x10 * best, s.frame);
+      sent_count++;
+
+      regs[TXB0CTRL + 0x10 * best] &= ~TXREQ;
+      regs[CANINTF] |= TX0IF << best;
+      update();
+
+      if (mode == MODE_LOOPBACK) receive(s.frame);
+      return best;
+    }
+
+    /*
+     * Sends every pending buffer. Returns how many went out.
+     */
+    int transmitAll()
+    {
+      int count = 0;
+      while (transmit() >= 0) count++;
+      return count;
+    }
+
+    /*
+     * Pulses the TXnRTS pins of the ORed TXBn buffers. Buffers whose BnRTSM bit is set are
+     * requested, the same as the RTS command.
+     */
+    void pulseRTS(byte buffers)
+    {
+      rts_pulses++;
+      requestSend(buffers & regs[TXRTSCTRL]);
+    }
+
+    /*
+     * Returns a sent frame. back = 0 is the most recent one.
+     */
+    const Sent& sent(unsigned long back = 0) const
+    {
+      return log_sent[(sent_count - 1 - back) % SENT_LOG];
+    }
+
+    /*
+     * Returns true while the RXnBF pin is low.
+     */
+    bool bufferPin(byte n) const
+    {
+      byte bfp = regs[BFPCTRL];
+      if (!(bfp & (B0BFE << n))) return false; // high impedance
+      if (bfp & (B0BFM << n)) return regs[CANINTF] & (RX0IF << n);
+      return !(bfp & (B0BFS << n));
+    }
+
+    byte reg(byte address) const { return read(address); }
+
+    // Transport lines
+    bool requestToSend(byte buffers) { pulseRTS(buffers); return true; }
+    bool bufferFull(byte& full)
+    {
+      full = (bufferPin(0) ? RX0IF : 0) | (bufferPin(1) ? RX1IF : 0);
+      return true;
+    }
+
+    unsigned long sent_count; // Frames transmitted
+    unsigned long rts_pulses; // Calls to pulseRTS()
+
+  protected:
+    void respond(const byte* tx, byte* rx, byte n)
+    {
+      memset(rx, 0, n);
+      if (n == 0) return;
+      byte cmd = tx[0];
+
+      if (cmd == CAN_RESET) {
+        reset();
+      } else if (cmd == CAN_READ) {
+        for (byte i = 2; i < n; i++) rx[i] = read(tx[1] + i - 2);
+      } else if (cmd == CAN_WRITE) {
+        for (byte i = 2; i < n; i++) write(tx[1] + i - 2, tx[i]);
+      } else if (cmd == CAN_BIT_MODIFY) {
+        if (n >= 4) write(tx[1], (read(tx[1]) & ~tx[2]) | (tx[3] & tx[2]));
+      } else if (cmd == CAN_STATUS) {
+        for (byte i = 1; i < n; i++) rx[i] = status();
+      } else if (cmd == CAN_RX_STATUS) {
+        byte f = regs[CANINTF];
+        for (byte i = 1; i < n; i++) rx[i] = ((f & RX0IF) ? RXSTAT_RX0IF : 0) | ((f & RX1IF) ? RXSTAT_RX1IF : 0);
+      } else if ((cmd & 0xF9) == CAN_READ_BUFFER) {
+        byte k = (cmd >> 1) & 0x03;
+        byte address = ((k & 0x02) ? RXB1CTRL : RXB0CTRL) + ((k & 0x01) ? 6 : 1);
+        for (byte i = 1; i < n; i++) rx[i] = read(address + i - 1);
+        regs[CANINTF] &= ~((k & 0x02) ? RX1IF : RX0IF); // cleared when CS goes high
+      } else if ((cmd & 0xF8) == CAN_LOAD_BUFFER && (cmd & 0x07) <= 5) {
+        byte k = cmd & 0x07;
+        byte address = TXB0CTRL + 0x10 * (k >> 1) + ((k & 0x01) ? 6 : 1);
+        for (byte i = 1; i < n; i++) write(address + i - 1, tx[i]);
+      } else if ((cmd & 0xF8) == CAN_RTS) {
+        requestSend(cmd & 0x07);
+      }
+      update();
+    }
+
+  private:
+    void reset()
+    {
+      memset(regs, 0, sizeof(regs));
+      regs[CANSTAT] = MODE_CONFIG;
+      regs[CANCTRL] = 0x87;
+      int_line = false;
+    }
+
+    byte read(byte address) const
+    {
+      address &= 0x7F;
+      if ((address & 0x0F) == 0x0E) return regs[CANSTAT];
+      if ((address & 0x0F) == 0x0F) return regs[CANCTRL];
+      if (address == TXRTSCTRL) return (regs[TXRTSCTRL] & 0x07) | B0RTS | B1RTS | B2RTS; // pins idle high
+      return regs[address];
+    }
+
+    void write(byte address, byte data)
+    {
+      address &= 0x7F;
+      bool config = (regs[CANSTAT] & MODE_MASK) == MODE_CONFIG;
+
+      if ((address & 0x0F) == 0x0E) return; // CANSTAT is read only
+      if ((address & 0x0F) == 0x0F) {
+        regs[CANCTRL] = data;
+        regs[CANSTAT] = (regs[CANSTAT] & ~MODE_MASK) | (data & MODE_MASK);
+        if (data & ABAT) {
+          for (byte n = 0; n < 3; n++) {
+            byte& ctrl = regs[TXB0CTRL + 0x10 * n];
+            if (ctrl & TXREQ) ctrl = (ctrl & ~TXREQ) | ABTF;
+          }
+        }
+        return;
+      }
+      if (address == TXRTSCTRL) {
+        if (config) regs[TXRTSCTRL] = data & 0x07;
+        return;
+      }
+      if (address >= CNF3 && address <= CNF1 && !config) return;
+      if (address == TXB0CTRL || address == TXB1CTRL || address == TXB2CTRL) {
+        regs[address] = (regs[address] & 0x70) | (data & (TXREQ | TXP_MASK));
+        if (config) regs[address] &= ~TXREQ;
+        return;
+      }
+      regs[address] = data;
+    }
+
+    void requestSend(byte buffers)
+    {
+      if ((regs[CANSTAT] & MODE_MASK) == MODE_CONFIG) return;
+      for (byte n = 0; n < 3; n++) {
+        if (buffers & (1 << n)) regs[TXB0CTRL + 0x10 * n] = (regs[TXB0CTRL + 0x10 * n] & ~ABTF) | TXREQ;
+      }
+    }
+
+    byte status() const
+    {
+      byte f = regs[CANINTF];
+      byte s = f & (RX0IF | RX1IF);
+      for (byte n = 0; n < 3; n++) {
+        if (regs[TXB0CTRL + 0x10 * n] & TXREQ) s |= 0x04 << (2 * n);
+        if (f & (TX0IF << n)) s |= 0x08 << (2 * n);
+      }
+      return s;
+    }
+
+    void update()
+    {
+      int_line = (regs[CANINTE] & regs[CANINTF]) != 0;
+    }
+
+    byte regs[128];
+    Sent log_sent[SENT_LOG];
+};
+
+#endif
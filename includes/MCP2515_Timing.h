@@ -0,0 +1,117 @@
+/*
+ * MCP2515_Timing.h
+ * Compile-time calculation of the MCP2515 bit timing registers (CNF1, CNF2, CNF3).
+ *
+ * The functions below follow the same steps as the runtime solver in MCP2515::_init():
+ * pick the smallest BRP that gives a whole number of time quanta (at most 25) per bit,
+ * put the sample point at 70% of the bit, and split the rest into PRSEG/PHSEG1/PHSEG2.
+ * Baud rates are in kbps and oscillator frequencies in MHz.
+ */
+
+#ifndef MCP2515_Timing_h
+#define MCP2515_Timing_h
+
+#include <stdint.h>
+#include "Arduino.h"
+
+/*
+ * Register values for one bit timing.
+ */
+struct MCP2515_Timing {
+	byte cnf1;
+	byte cnf2;
+	byte cnf3;
+};
+
+// Baud rate prescaler. Returns 8 if no prescaler gives a whole number of quanta.
+constexpr byte mcp2515_brp(long baud, byte freq, byte brp = 0)
+{
+	return brp >= 8 ? 8
+		: ((1000L * freq) % (2L * (brp + 1) * baud) == 0 && (1000L * freq) / (2L * (brp + 1) * baud) <= 25) ? brp
+		: mcp2515_brp(baud, freq, brp + 1);
+}
+
+// Time quanta per bit
+constexpr byte mcp2515_bt(long baud, byte freq)
+{
+	return mcp2515_brp(baud, freq) >= 8 ? 0 : (1000L * freq) / (2L * (mcp2515_brp(baud, freq) + 1) * baud);
+}
+
+// Sample point, in time quanta
+constexpr byte mcp2515_spt(long baud, byte freq) { return (7 * mcp2515_bt(baud, freq)) / 10; }
+
+constexpr byte mcp2515_prseg(long baud, byte freq) { return (mcp2515_spt(baud, freq) - 1) / 2; }
+
+constexpr byte mcp2515_phseg1(long baud, byte freq)
+{
+	return mcp2515_spt(baud, freq) - mcp2515_prseg(baud, freq) - 1;
+}
+
+constexpr byte mcp2515_phseg2(long baud, byte freq)
+{
+	return mcp2515_bt(baud, freq) - mcp2515_phseg1(baud, freq) - mcp2515_prseg(baud, freq) - 1;
+}
+
+// True if the segments fit the MCP2515's register ranges and programming requirements.
+constexpr bool mcp2515_timing_valid(long baud, byte freq, byte sjw)
+{
+	return mcp2515_brp(baud, freq) < 8 &&
+		mcp2515_prseg(baud, freq) >= 1 && mcp2515_prseg(baud, freq) <= 8 &&
+		mcp2515_phseg1(baud, freq) >= 1 && mcp2515_phseg1(baud, freq) <= 8 &&
+		mcp2515_phseg2(baud, freq) >= 2 && mcp2515_phseg2(baud, freq) <= 8 &&
+		mcp2515_prseg(baud, freq) + mcp2515_phseg1(baud, freq) >= mcp2515_phseg2(baud, freq) &&
+		mcp2515_phseg2(baud, freq) > sjw &&
+		sjw >= 1 && sjw <= 4;
+}
+
+constexpr byte mcp2515_cnf1(long baud, byte freq, byte sjw)
+{
+	return ((sjw - 1) << 6) | mcp2515_brp(baud, freq);
+}
+
+// BTLMODE = 1, SAM = 0
+constexpr byte mcp2515_cnf2(long baud, byte freq)
+{
+	return 0x80 | ((mcp2515_phseg1(baud, freq) - 1) << 3) | (mcp2515_prseg(baud, freq) - 1);
+}
+
+// SOF = 1
+constexpr byte mcp2515_cnf3(long baud, byte freq)
+{
+	return 0x80 | (mcp2515_phseg2(baud, freq) - 1);
+}
+
+/*
+ * Bit timing checked at compile time:
+ *   controller.Init(MCP2515_BitTiming<500, 16>::value);
+ */
+template <long Baud, byte Freq, byte SJW = 1>
+struct MCP2515_BitTiming {
+	static_assert(mcp2515_timing_valid(Baud, Freq, SJW), "The MCP2515 cannot run at this baud rate with this oscillator and SJW");
+
+	static constexpr MCP2515_Timing value = {
+		mcp2515_cnf1(Baud, Freq, SJW), mcp2515_cnf2(Baud, Freq), mcp2515_cnf3(Baud, Freq)};
+};
+
+template <long Baud, byte Freq, byte SJW>
+constexpr MCP2515_Timing MCP2515_BitTiming<Baud, Freq, SJW>::value;
+
+/*
+ * Entry in the table of standard rates used by MCP2515::_init(). CNF1 is built at runtime from
+ * brp and the requested SJW, which must be less than phseg2.
+ */
+struct MCP2515_TimingEntry {
+	uint16_t baud;
+	byte freq;
+	byte brp;
+	byte cnf2;
+	byte cnf3;
+	byte phseg2;
+};
+
+// Going through MCP2515_BitTiming makes the static_assert check each entry.
+#define MCP2515_TIMING_ENTRY(baud, freq) \
+	{baud, freq, mcp2515_brp(baud, freq), MCP2515_BitTiming<baud, freq>::value.cnf2, \
+	 MCP2515_BitTiming<baud, freq>::value.cnf3, mcp2515_phseg2(baud, freq)}
+
+#endif
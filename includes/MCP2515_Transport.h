@@ -0,0 +1,69 @@
+/*
+ * MCP2515_Transport.h
+ * Interface between the MCP2515 driver and the bus it talks over.
+ */
+
+#ifndef MCP2515_Transport_h
+#define MCP2515_Transport_h
+
+#include <stdint.h>
+#include "Arduino.h"
+
+// Longest single SPI transaction the driver issues: instruction + address/header + 13 buffer bytes.
+#define MCP2515_MAX_TRANSFER 16
+
+// Pin number used when a pin is not connected.
+#define MCP2515_NO_PIN 0xFF
+
+/*
+ * A transport carries whole SPI transactions to the MCP2515 and reports the INT line.
+ * Each call to transfer() is one transaction: CS is asserted, n bytes are clocked out from tx
+ * (and in to rx), and CS is released. tx and rx may point to the same buffer, and rx may be 0
+ * if the response is not needed. n is never larger than MCP2515_MAX_TRANSFER.
+ */
+class MCP2515_Transport
+{
+  public:
+    virtual void begin() {}
+    virtual void transfer(const byte* tx, byte* rx, byte n) = 0;
+    virtual bool interrupt() = 0; // true while INT is asserted (low), always true if INT is not connected
+
+    /*
+     * Optional TXnRTS and RXnBF lines. requestToSend() pulses the TXnRTS pins of the ORed TXBn
+     * buffers and returns false (doing nothing) if any of them is not connected. bufferFull() sets
+     * full to RX0IF/RX1IF for each RXnBF pin that is low, and returns false if they are not connected.
+     */
+    virtual bool requestToSend(byte buffers) { (void)buffers; return false; }
+    virtual bool bufferFull(byte& full) { (void)full; return false; }
+
+  protected:
+    ~MCP2515_Transport() {} // Not deleted through a base pointer
+};
+
+/*
+ * Default transport using the Arduino SPI library and a CS/INT pin pair.
+ * The buffer overload of SPI.transfer() is used, so each core uses its own block transfer.
+ */
+class MCP2515_SPI : public MCP2515_Transport
+{
+  public:
+    MCP2515_SPI(byte CS_Pin, byte INT_Pin);
+
+    // Connect the TXnRTS and RXnBF pins (MCP2515_NO_PIN if not wired)
+    void setRTSPins(byte TX0RTS_Pin, byte TX1RTS_Pin, byte TX2RTS_Pin);
+    void setBufferPins(byte RX0BF_Pin, byte RX1BF_Pin);
+
+    void begin();
+    void transfer(const byte* tx, byte* rx, byte n);
+    bool interrupt();
+    bool requestToSend(byte buffers);
+    bool bufferFull(byte& full);
+
+  private:
+    byte _CS;
+    byte _INT;
+    byte _RTS[3];
+    byte _BF[2];
+};
+
+#endif
@@ -15,6 +15,7 @@
 #define MCP2515_defs_h
 
 #include <stdint.h>
+#include <string.h>
 #include "Arduino.h"
 
 typedef struct
@@ -24,6 +25,7 @@ typedef struct
       byte rtr = 0;                  // Remote Transmission Request
       byte ide = 0;                  // Extended ID flag
       byte dlc = 0;                  // Number of data bytes
+      unsigned long timestamp = 0;   // CAN_Micros() when Fetch() saw the frame (0 if not received)
       union {
         // 8 bytes
         uint64_t value;
@@ -41,8 +43,8 @@ typedef struct
         };
         // 4 bytes (signed int)
         struct {
-          signed long  low_s;
-          signed long  high_s;
+          int32_t  low_s;
+          int32_t  high_s;
         };
         // 2 Bytes
         struct {
@@ -53,18 +55,23 @@ typedef struct
         };
         // 2 bytes (signed)
         struct {
-          signed int i0;
-          signed int i1;
-          signed int i2;
-          signed int i3;
+          int16_t  i0;
+          int16_t  i1;
+          int16_t  i2;
+          int16_t  i3;
         };
         // 1 byte
         uint8_t data[8];
-
-        // 1 Bit
-        bool bitData[64];
       };
 
+  // 1 Bit (bit n is bit n%8 of data[n/8])
+  bool bit(byte n) const { return (data[n >> 3] >> (n & 7)) & 1; }
+  void setBit(byte n, bool set)
+  {
+    if (set) data[n >> 3] |= (1 << (n & 7));
+    else     data[n >> 3] &= ~(1 << (n & 7));
+  }
+
   String toString()
   {
     char fstring[64];
@@ -77,6 +84,127 @@ typedef struct
 
 } Frame;
 
+/*
+ * Packed frame for storage, 16 bytes at most (13 on AVR): the 29-bit ID with IDE and RTR
+ * folded into the top bits, the DLC and the payload. It has no timestamp or SRR.
+ * Converts to and from Frame, e.g.
+ *   CompactFrame c = frame;
+ *   Frame f = c;
+ */
+struct CompactFrame
+{
+  static const uint32_t IDE_FLAG = 0x80000000UL;
+  static const uint32_t RTR_FLAG = 0x40000000UL;
+  static const uint32_t ID_MASK  = 0x1FFFFFFFUL;
+
+  uint32_t ident;  // ID | IDE_FLAG | RTR_FLAG
+  uint8_t  dlc;
+  uint8_t  data[8];
+
+  CompactFrame() : ident(0), dlc(0) {}
+  CompactFrame(const Frame& f)
+    : ident((f.id & ID_MASK) | (f.ide ? IDE_FLAG : 0) | (f.rtr ? RTR_FLAG : 0)), dlc(f.dlc & 0x0F)
+  {
+    memcpy(data, f.data, 8);
+  }
+
+  operator Frame() const
+  {
+    Frame f;
+    f.id = id();
+    f.ide = ide();
+    f.rtr = rtr();
+    f.dlc = dlc;
+    memcpy(f.data, data, 8);
+    return f;
+  }
+
+  uint32_t id() const { return ident & ID_MASK; }
+  bool ide() const { return ident & IDE_FLAG; }
+  bool rtr() const { return ident & RTR_FLAG; }
+  bool bit(byte n) const { return (data[n >> 3] >> (n & 7)) & 1; }
+  void setBit(byte n, bool set)
+  {
+    if (set) data[n >> 3] |= (1 << (n & 7));
+    else     data[n >> 3] &= ~(1 << (n & 7));
+  }
+};
+
+static_assert(sizeof(CompactFrame) <= 16, "CompactFrame must fit in 16 bytes");
+
+/*
+ * A TX buffer the way LOAD TX BUFFER clocks it in: the command byte, then TXBnSIDH..TXBnD7
+ * (13 bytes) back to back, so MCP2515::LoadImage() sends it from here without copying.
+ * Layouts fill one in with encode(). The payload has the same views as Frame's.
+ */
+struct MCP2515_TXImage
+{
+  byte reserved[2];  // Puts the payload on an 8 byte boundary
+  byte command;      // Written by LoadImage()
+  byte header[5];    // TXBnSIDH, TXBnSIDL, TXBnEID8, TXBnEID0, TXBnDLC (MCP2515::EncodeHeader())
+  union {
+    uint64_t value;
+    int64_t  value_s;
+    struct { float    low_f, high_f; };
+    struct { uint32_t low, high; };
+    struct { int32_t  low_s, high_s; };
+    struct { uint16_t s0, s1, s2, s3; };
+    struct { int16_t  i0, i1, i2, i3; };
+    uint8_t data[8];
+  };
+
+  uint32_t id() const
+  {
+    if (ide())
+      return ((uint32_t)header[0] << 21) | ((uint32_t)(header[1] & 0xE0) << 13) |
+             ((uint32_t)(header[1] & 0x03) << 16) | ((uint32_t)header[2] << 8) | header[3];
+    return ((uint32_t)header[0] << 3) | (header[1] >> 5);
+  }
+  bool ide() const { return header[1] & 0x08; }
+  bool rtr() const { return header[4] & 0x40; }
+  byte dlc() const { return header[4] & 0x0F; }
+};
+
+static_assert(sizeof(MCP2515_TXImage) == 16, "MCP2515_TXImage must be the command and the 13 buffer registers");
+
+/*
+ * Microsecond clock used for receive timestamps: micros() on the board, and a monotonic
+ * std::chrono clock if ARDUINO is not defined. Wraps like micros().
+ */
+#if defined(ARDUINO)
+inline unsigned long CAN_Micros() { return micros(); }
+#else
+#include <chrono>
+inline unsigned long CAN_Micros()
+{
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+/*
+ * Returns the frame's arbitration field as it goes out on the bus, so that a lower key wins
+ * arbitration (higher priority). Standard frames beat extended frames with the same SID,
+ * and data frames beat remote frames.
+ */
+inline uint32_t CAN_ArbitrationKey(uint32_t id, bool ide, bool rtr)
+{
+  if (ide)  // SID, SRR, IDE, EID, RTR
+    return ((uint32_t)(id >> 18) << 21) | (1UL << 20) | (1UL << 19) | ((uint32_t)(id & 0x3FFFF) << 1) | (rtr ? 1 : 0);
+  else      // SID, RTR, IDE
+    return ((uint32_t)(id & 0x7FF) << 21) | ((uint32_t)(rtr ? 1 : 0) << 20);
+}
+
+inline uint32_t CAN_ArbitrationKey(const Frame& f)
+{
+  return CAN_ArbitrationKey(f.id, f.ide, f.rtr);
+}
+
+inline uint32_t CAN_ArbitrationKey(const MCP2515_TXImage& image)
+{
+  return CAN_ArbitrationKey(image.id(), image.ide(), image.rtr());
+}
+
 // MCP2515 SPI Commands
 #define CAN_RESET       0xC0
 #define CAN_READ        0x03
@@ -95,6 +223,7 @@ typedef struct
 #define MODE_LOOPBACK          0x40
 #define MODE_SLEEP             0x20
 #define MODE_NORMAL            0x00
+#define MODE_MASK              0xE0 // OPMOD bits in CANSTAT, REQOP bits in CANCTRL
 // CANINTF
 #define RX0IF                  0x01
 #define RX1IF                  0x02
@@ -106,6 +235,45 @@ typedef struct
 #define MERRF                  0x80
 #define INTALL                 0xFF
 
+// RX STATUS instruction result
+#define RXSTAT_RX0IF           0x40
+#define RXSTAT_RX1IF           0x80
+
+// READ STATUS instruction result (the RXnIF/TXnIF bits are copies of CANINTF)
+#define STAT_TX0REQ            0x04
+#define STAT_TX0IF             0x08
+#define STAT_TX1REQ            0x10
+#define STAT_TX1IF             0x20
+#define STAT_TX2REQ            0x40
+#define STAT_TX2IF             0x80
+
+// TXRTSCTRL (the BnRTSM bits line up with the TXBn buffer masks)
+#define B0RTSM                 0x01 // TX0RTS pin requests TXB0 to send (otherwise a digital input)
+#define B1RTSM                 0x02
+#define B2RTSM                 0x04
+#define B0RTS                  0x08 // State of TX0RTS pin (read only)
+#define B1RTS                  0x10
+#define B2RTS                  0x20
+
+// BFPCTRL (the BnBFM bits line up with RX0IF/RX1IF)
+#define B0BFM                  0x01 // RX0BF pin goes low when RXB0 is full (otherwise a digital output)
+#define B1BFM                  0x02
+#define B0BFE                  0x04 // RX0BF pin enabled
+#define B1BFE                  0x08
+#define B0BFS                  0x10 // RX0BF pin state when used as a digital output
+#define B1BFS                  0x20
+
+// TXBnCTRL
+#define TXREQ                  0x08
+#define TXERR                  0x10 // A bus error happened while sending
+#define MLOA                   0x20 // Lost arbitration
+#define ABTF                   0x40
+#define TXP_MASK               0x03
+
+// CANCTRL
+#define ABAT                   0x10
+#define OSM                    0x08 // One-shot mode: no retry after an error or lost arbitration
+
 // CANINTE
 #define RX0IE                  0x01
 #define RX1IE                  0x02
@@ -117,6 +285,7 @@ typedef struct
 #define MERRE                  0x80
 
 // Configuration Registers
+// (CANSTAT and CANCTRL are also mirrored at every xEh and xFh address)
 #define CANSTAT         0x0E
 #define CANCTRL         0x0F
 #define BFPCTRL         0x0C
@@ -10,18 +10,82 @@
 #include "MCP2515_defs.h"
 
 
+// Called by drain() for each frame. The frame is only valid during the call.
+typedef void (*FrameCallback)(const Frame& frame, void* context);
+
+/*
+ * Interface shared by the frame queues, so CAN_IO can feed a queue chosen by the user
+ * (e.g. a separate lane for RXB1 traffic). See RX_Queue for what each method does.
+ */
+class Frame_Lane {
+public:
+	virtual bool is_full() = 0;
+	virtual bool is_empty() = 0;
+	virtual int size() = 0;
+	virtual bool enqueue(const Frame& f) = 0; // Returns false if f was dropped
+	virtual Frame& dequeue() = 0;
+	virtual const Frame* peek() = 0;
+	virtual void commit() = 0;
+	virtual uint32_t dropped() = 0;
+
+	/*
+	 * Bulk removal: copies up to n frames into out, or passes them to fn. Return the number
+	 * of frames removed. These versions go frame by frame; the queues replace them with a
+	 * single pass.
+	 */
+	virtual int read_many(Frame* out, int n) {
+		int count = 0;
+		const Frame* f;
+		while (count < n && (f = peek())) {
+			out[count++] = *f;
+			commit();
+		}
+		return count;
+	}
+
+	virtual int drain(FrameCallback fn, void* context, int n) {
+		int count = 0;
+		const Frame* f;
+		while (count < n && (f = peek())) {
+			fn(*f, context);
+			commit();
+			count++;
+		}
+		return count;
+	}
+
+protected:
+	~Frame_Lane() {}
+};
+
+/*
+ * What RX_Queue does with a new frame when it is full. Every policy counts the frame it
+ * loses in dropped().
+ */
+#define RXQ_OVERWRITE_NEWEST        0 // Replace the last frame added (default)
+#define RXQ_DROP_OLDEST             1 // Discard the frame at the tail to make room
+#define RXQ_DROP_NEWEST             2 // Discard the new frame
+#define RXQ_OVERWRITE_SAME_ID       3 // Replace a queued frame with the same ID, else drop the oldest
+#define RXQ_EVICT_LOWEST_PRIORITY   4 // Discard the lowest priority frame (highest ID), which may be the new one
+
 /*
  * Static receiving deque for CAN_IO class. Holds frames that
  * have come in over the CAN bus.
  */
-template<int Tsize>
-class RX_Queue {
+template<int Tsize, int Policy = RXQ_OVERWRITE_NEWEST>
+class RX_Queue : public Frame_Lane {
 	/*Usage:
-		- void	enqueue(Frame)	 -- Adds Frame to the head of the queue
+		- bool	enqueue(Frame)	 -- Adds Frame to the head of the queue (false if it was dropped)
 		- Frame dequeue()		 -- Returns a Frame from the tail of the queue
 		- bool	is_full()		 -- Returns true if the queue is full
 		- bool	is_empty()		 -- Returns true if there are no elements in the queue
 		- int	size()			 -- Returns the number of elements in the queue
+		- Frame* peek()			 -- Returns the frame at the tail without removing it (0 if empty)
+		- void	commit()		 -- Removes the frame returned by peek()
+		- long	dropped()		 -- Returns the number of frames lost to overflow
+		- int	high_water()	 -- Returns the largest size() seen
+		- int	read_many(Frame*, n) -- Copies up to n frames out of the queue
+		- int	drain(fn, context, n) -- Passes up to n frames to fn and removes them
 		*/
 public:
 	static const int RX_QUEUE_SIZE = Tsize;
@@ -29,7 +93,7 @@ public:
 	/*
 	 * Constructor. Initializes the queue.
 	 */
-	RX_Queue() : head(0), tail(0), isFull(0) {}
+	RX_Queue() : head(0), tail(0), isFull(0), peeked(false), dropped_count(0), high_mark(0) {}
 
 	/*
 	 * Returns true if the queue is full.
@@ -52,29 +116,101 @@ public:
 		else
 			return (head - tail + RX_QUEUE_SIZE) % RX_QUEUE_SIZE;
 	}
+
 	/*
-	 * Adds a frame to the front of the queue.
+	 * Overflow statistics, for sizing the queue.
 	 */
-	void enqueue(const Frame& f) {
+	uint32_t dropped() {
 		noInterrupts();
-		if (!is_full()) {
-			//Add frame to head
-			buf[head++] = f;
+		uint32_t count = dropped_count;
+		interrupts();
+		return count;
+	}
+	int high_water() { return high_mark; }
+	void reset_stats() {
+		noInterrupts();
+		dropped_count = 0;
+		high_mark = size();
+		interrupts();
+	}
 
-			// Wrap Head
-			if (head >= RX_QUEUE_SIZE) {
-				head = 0;
+	/*
+	 * Adds a frame to the front of the queue. If the queue is full, Policy decides which frame is lost.
+	 * A frame held by peek() is never overwritten; if the policy would need its slot, the new
+	 * frame is dropped instead. Returns false if the new frame was dropped.
+	 */
+	bool enqueue(const Frame& f) {
+		noInterrupts();
+		bool kept = true;
+		if (!is_full()) {
+			push(f);
+		}
+		else {
+			dropped_count++;
+			if (Policy == RXQ_DROP_OLDEST) {
+				kept = drop_oldest(f);
 			}
-
-			//Check whether full
-			if (head == tail) {
-				isFull = true;
+			else if (Policy == RXQ_OVERWRITE_SAME_ID) {
+				int i = find_id(f);
+				if (i >= 0 && !(peeked && i == tail)) {
+					buf[i] = f;
+				}
+				else {
+					kept = drop_oldest(f);
+				}
+			}
+			else if (Policy == RXQ_EVICT_LOWEST_PRIORITY) {
+				int i = find_lowest_priority();
+				if (i >= 0 && CAN_ArbitrationKey(f) < CAN_ArbitrationKey(buf[i])) {
+					remove(i);
+					push(f);
+				}
+				else {
+					kept = false;
+				}
+			}
+			else if (Policy != RXQ_DROP_NEWEST) { // If full, we overwrite the last added message.
+				int last = (head + RX_QUEUE_SIZE - 1) % RX_QUEUE_SIZE;
+				if (!(peeked && last == tail))
+					buf[last] = f;
+				else
+					kept = false;
+			}
+			else {
+				kept = false;
 			}
 		}
-		else { // If full, we overwrite the last added message.
-			buf[(head + RX_QUEUE_SIZE - 1) % RX_QUEUE_SIZE] = f;
+
+		if (size() > high_mark)
+			high_mark = size();
+		interrupts();
+		return kept;
+	}
+
+	/*
+	 * Returns the frame at the back of the queue without removing it, or 0 if the queue is empty.
+	 * The frame stays in place (enqueue() will not overwrite it) until commit() is called, so
+	 * it can be decoded straight from the queue, e.g. TRI88_Drive d(*f).
+	 */
+	const Frame* peek() {
+		noInterrupts();
+		const Frame* r = 0;
+		if (!is_empty()) {
+			peeked = true;
+			r = &buf[tail];
 		}
 		interrupts();
+		return r;
+	}
+
+	/*
+	 * Removes the frame returned by peek().
+	 */
+	void commit() {
+		noInterrupts();
+		if (peeked && !is_empty())
+			pop();
+		interrupts();
 	}
 
 	/*
@@ -82,64 +218,387 @@ public:
 	 */
 	Frame dequeue_copy() {
 		noInterrupts();
+		Frame r = Frame();
 		if (!is_empty()) {
-			//Update tail location
-			uint8_t readloc = tail++;
-
-			//Wrap tail
-			if (tail >= RX_QUEUE_SIZE) {
-				tail = 0;
-			}
-
-			//Check whether queue has been emptied
-			if (tail == head) {
-				isFull = false;
-			}
-			Frame r = buf[readloc];
-			interrupts();
-			return r;
+			r = buf[tail];
+			pop();
 		}
-		return Frame();
+		interrupts();
+		return r;
 	}
 	/*
 	 * Returns a frame reference from the back of the queue.
 	 */
 	Frame& dequeue() {
+		noInterrupts();
 		if (!is_empty()) {
-			//Update tail location
-			uint8_t readloc = tail++;
-
-			//Wrap tail
-			if (tail >= RX_QUEUE_SIZE) {
-				tail = 0;
-			}
-
-			//Check whether queue has been emptied
-			if (tail == head) {
-				isFull = false;
-			}
+			uint8_t readloc = tail;
+			pop();
+			interrupts();
 			return buf[readloc];
 		}
+		interrupts();
 		return buf[head]; //Return last element if it fails.
 	}
 
+	/*
+	 * Copies up to n frames from the back of the queue into out, with interrupts disabled
+	 * once for the whole batch. Returns the number of frames copied.
+	 * drain() is the frame by frame version from Frame_Lane, so callbacks run with
+	 * interrupts enabled.
+	 */
+	int read_many(Frame* out, int n) {
+		noInterrupts();
+		int count = 0;
+		while (count < n && !is_empty()) {
+			out[count++] = buf[tail];
+			pop();
+		}
+		interrupts();
+		return count;
+	}
+
 private:
+	/*
+	 * Helpers. Called with interrupts disabled.
+	 */
+	void push(const Frame& f) {
+		//Add frame to head
+		buf[head++] = f;
+
+		// Wrap Head
+		if (head >= RX_QUEUE_SIZE) {
+			head = 0;
+		}
+
+		//Check whether full
+		if (head == tail) {
+			isFull = true;
+		}
+	}
+
+	void pop() {
+		peeked = false;
+
+		//Update tail location
+		tail++;
+
+		//Wrap tail
+		if (tail >= RX_QUEUE_SIZE) {
+			tail = 0;
+		}
+
+		//Check whether queue has been emptied
+		if (tail == head) {
+			isFull = false;
+		}
+	}
+
+	int find_id(const Frame& f) {
+		for (int n = 0, i = tail; n < size(); n++, i = (i + 1) % RX_QUEUE_SIZE) {
+			if (buf[i].id == f.id && buf[i].ide == f.ide)
+				return i;
+		}
+		return -1;
+	}
+
+	// Returns the lowest priority frame that may be evicted, or -1 if there is none.
+	int find_lowest_priority() {
+		int worst = -1;
+		for (int n = 0, i = tail; n < size(); n++, i = (i + 1) % RX_QUEUE_SIZE) {
+			if (peeked && i == tail)
+				continue;
+			if (worst < 0 || CAN_ArbitrationKey(buf[i]) > CAN_ArbitrationKey(buf[worst]))
+				worst = i;
+		}
+		return worst;
+	}
+
+	// Makes room by dropping the oldest frame that is not held by peek().
+	bool drop_oldest(const Frame& f) {
+		if (!peeked) {
+			pop();
+			push(f);
+		}
+		else if (RX_QUEUE_SIZE > 1) {
+			remove((tail + 1) % RX_QUEUE_SIZE);
+			push(f);
+		}
+		else {
+			return false;
+		}
+		return true;
+	}
+
+	// Removes buf[i], moving the newer frames back one place to keep them in order.
+	void remove(int i) {
+		int last = (head + RX_QUEUE_SIZE - 1) % RX_QUEUE_SIZE;
+		while (i != last) {
+			int next = (i + 1) % RX_QUEUE_SIZE;
+			buf[i] = buf[next];
+			i = next;
+		}
+		head = last;
+		isFull = false;
+	}
+
 	Frame buf[RX_QUEUE_SIZE];
 	uint8_t head;
 	uint8_t tail;
 	bool	isFull;
+	bool	peeked;		// The tail frame is held by peek()
+	uint32_t dropped_count;
+	uint8_t high_mark;
+};
+
+/*
+ * Compiler barrier. Stops the compiler from moving memory accesses across it, which is all
+ * that is needed between an ISR and the main loop on a single core.
+ */
+#define SPSC_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+/*
+ * Gives a queue a Frame view of its storage. Frames are used in place; other storage
+ * types (e.g. CompactFrame) are converted into a scratch Frame, which stays valid until
+ * the next call.
+ */
+template<class FrameT>
+struct Frame_View {
+	Frame& view(const FrameT& f) { scratch = f; return scratch; }
+	Frame scratch;
+};
+
+template<>
+struct Frame_View<Frame> {
+	Frame& view(Frame& f) { return f; }
+};
+
+/*
+ * Lock-free receiving queue for one producer and one consumer, e.g. Fetch() running from an
+ * interrupt and Read() running in the main loop. Only enqueue() writes head and only dequeue()
+ * writes tail, so neither side disables interrupts (only the statistics calls do).
+ * The indices run freely and are masked, so Tsize must be a power of two (at most 128).
+ * If the queue is full, the new frame is dropped.
+ * FrameT is the storage type. With CompactFrame the queue takes a quarter of the RAM, but
+ * peek() and dequeue() return a converted copy instead of the slot itself.
+ */
+template<int Tsize, class FrameT = Frame>
+class SPSC_Queue : public Frame_Lane, private Frame_View<FrameT> {
+	static_assert(Tsize > 0 && Tsize <= 128 && (Tsize & (Tsize - 1)) == 0, "SPSC_Queue size must be a power of two, up to 128");
+
+public:
+	static const int RX_QUEUE_SIZE = Tsize;
+
+	/*
+	 * Constructor. Initializes the queue.
+	 */
+	SPSC_Queue() : head(0), tail(0), dropped_count(0), high_mark(0) {}
+
+	/*
+	 * Returns true if the queue is full.
+	 */
+	bool is_full() {
+		return uint8_t(head - tail) == RX_QUEUE_SIZE;
+	}
+
+	/*
+	 * Returns true if the queue is empty.
+	 */
+	bool is_empty() {
+		return head == tail;
+	}
+
+	int size() {
+		return uint8_t(head - tail);
+	}
+
+	/*
+	 * Overflow statistics, for sizing the queue. Updated by the producer, so these disable
+	 * interrupts while dropped_count (too wide to read or write in one instruction on AVR) is used.
+	 */
+	uint32_t dropped() {
+		noInterrupts();
+		uint32_t count = dropped_count;
+		interrupts();
+		return count;
+	}
+	int high_water() { return high_mark; }
+	void reset_stats() {
+		noInterrupts();
+		dropped_count = 0;
+		high_mark = 0;
+		interrupts();
+	}
+
+	/*
+	 * Adds a frame to the front of the queue. Producer side only.
+	 * Returns false (dropping the frame) if the queue is full.
+	 */
+	bool enqueue(const Frame& f) {
+		uint8_t h = head;
+		uint8_t used = uint8_t(h - tail);
+		if (used == RX_QUEUE_SIZE) {
+			dropped_count++;
+			return false;
+		}
+
+		buf[h & MASK] = f;
+		SPSC_BARRIER(); // Frame must be written before the consumer can see it
+		head = h + 1;
+		if (used + 1 > high_mark)
+			high_mark = used + 1;
+		return true;
+	}
+
+	/*
+	 * Returns the frame at the back of the queue without removing it, or 0 if the queue is empty.
+	 * Consumer side only. The producer cannot reuse the slot until commit() is called, so the
+	 * frame can be decoded straight from the queue with no copy.
+	 */
+	const Frame* peek() {
+		uint8_t t = tail;
+		if (head == t)
+			return 0;
+
+		SPSC_BARRIER();
+		return &this->view(buf[t & MASK]);
+	}
+
+	/*
+	 * Removes the frame returned by peek(). Consumer side only.
+	 */
+	void commit() {
+		uint8_t t = tail;
+		if (head == t)
+			return;
+
+		SPSC_BARRIER(); // Frame must be finished with before the producer can reuse the slot
+		tail = t + 1;
+	}
+
+	/*
+	 * Returns a frame from the back of the queue. Consumer side only.
+	 */
+	Frame dequeue_copy() {
+		uint8_t t = tail;
+		if (head == t)
+			return Frame();
+
+		SPSC_BARRIER();
+		Frame r = this->view(buf[t & MASK]);
+		SPSC_BARRIER(); // Frame must be read before the producer can reuse the slot
+		tail = t + 1;
+		return r;
+	}
+
+	/*
+	 * Returns a frame reference from the back of the queue. Consumer side only.
+	 * The slot is handed back to the producer, so the reference is only valid until
+	 * the queue fills up again.
+	 */
+	Frame& dequeue() {
+		uint8_t t = tail;
+		if (head == t)
+			return this->view(buf[t & MASK]); //Return last element if it fails.
+
+		SPSC_BARRIER();
+		Frame& r = this->view(buf[t & MASK]); // Converted before the slot is released
+		SPSC_BARRIER();
+		tail = t + 1;
+		return r;
+	}
+
+	/*
+	 * Copies up to n frames into out. Consumer side only. head is read once, so the batch
+	 * is one consistent snapshot, and tail is written once at the end.
+	 * Returns the number of frames copied.
+	 */
+	int read_many(Frame* out, int n) {
+		uint8_t t = tail;
+		int count = uint8_t(head - t);
+		if (count > n)
+			count = n;
+
+		SPSC_BARRIER();
+		for (int i = 0; i < count; i++)
+			out[i] = this->view(buf[uint8_t(t + i) & MASK]);
+		SPSC_BARRIER(); // Frames must be read before the producer can reuse the slots
+		tail = t + count;
+		return count;
+	}
+
+	/*
+	 * Passes up to n frames to fn, straight from their slots. Consumer side only.
+	 * The slots are handed back to the producer after the last call, so keep fn short:
+	 * the queue has less room while it runs.
+	 */
+	int drain(FrameCallback fn, void* context, int n) {
+		uint8_t t = tail;
+		int count = uint8_t(head - t);
+		if (count > n)
+			count = n;
+
+		SPSC_BARRIER();
+		for (int i = 0; i < count; i++)
+			fn(this->view(buf[uint8_t(t + i) & MASK]), context);
+		SPSC_BARRIER();
+		tail = t + count;
+		return count;
+	}
+
+private:
+	static const uint8_t MASK = Tsize - 1;
+
+	FrameT buf[RX_QUEUE_SIZE];
+	volatile uint8_t head;
+	volatile uint8_t tail;
+	volatile uint32_t dropped_count;
+	volatile uint8_t high_mark;
+};
+
+/*
+ * Interface of the frame deques, so CAN_IO can use one sized by CAN_IO_T.
+ * See RX_Deque for what each method does.
+ */
+class Frame_Deque {
+public:
+	virtual bool is_full() = 0;
+	virtual bool is_empty() = 0;
+	virtual int size() = 0;
+	virtual bool enqueue_head(const Frame& f) = 0; // Returns false if the deque is full
+	virtual Frame dequeue_head() = 0;
+	virtual bool enqueue_tail(const Frame& f) = 0;
+	virtual Frame dequeue_tail() = 0;
+
+protected:
+	~Frame_Deque() {}
 };
 
 /* Frame Deque */
+/*
+ * Used as a queue, frames go in at the head and come out at the tail; enqueue_tail() puts
+ * one back at the front of the line. CAN_IO uses it for TXbuffer, so a frame that could
+ * not be sent is retried before the ones queued after it.
+ * It does not lock: disable interrupts around it if an ISR uses it too.
+ */
 template <int Tsize>
-class RX_Deque {
+class RX_Deque : public Frame_Deque {
+	/*Usage:
+		- bool	enqueue_head(Frame)	 -- Adds Frame at the head (false if full)
+		- Frame dequeue_head()		 -- Removes the Frame added last
+		- bool	enqueue_tail(Frame)	 -- Adds Frame at the tail, to come out next (false if full)
+		- Frame dequeue_tail()		 -- Removes the oldest Frame
+		- bool	is_full()			 -- Returns true if the deque is full
+		- bool	is_empty()			 -- Returns true if there are no elements in the deque
+		- int	size()				 -- Returns the number of elements in the deque
+		*/
 public:
 	static const int RX_DEQUE_SIZE = Tsize;
 
 	/*
 	 * Constructor. Initializes the deque.
 	 */
-	RX_Deque() : head(0), tail(0) {}
+	RX_Deque() : head(0), tail(0), isFull(false) {}
 
 	/*
 	 * Returns true if the deque is full.
@@ -166,25 +625,24 @@ public:
 	}
 
 	/*
-	 * Adds a frame at the head of the deque.
+	 * Adds a frame at the head of the deque. Returns false (and drops it) if the deque is full.
 	 */
-	void enqueue_head(const Frame& f) {
-		if (!is_full()) {
-			buf[head++] = f;
+	bool enqueue_head(const Frame& f) {
+		if (is_full())
+			return false;
 
-			// Wrap Head
-			if (head >= RX_DEQUE_SIZE) {
-				head = 0;
-			}
+		buf[head++] = f;
 
-			//Check whether full
-			if (head == tail) {
-				isFull = true;
-			}
+		// Wrap Head
+		if (head >= RX_DEQUE_SIZE) {
+			head = 0;
 		}
-		else { // If full, we overwrite the last added message.
-			buf[(head + RX_DEQUE_SIZE - 1) % RX_DEQUE_SIZE] = f;
+
+		//Check whether full
+		if (head == tail) {
+			isFull = true;
 		}
+		return true;
 	}
 
 
@@ -200,10 +658,8 @@ public:
 
 			uint8_t readloc = --head;
 
-			//Check whether queue has been emptied
-			if (tail == head) {
-				isFull = false;
-			}
+			// Removing a frame always leaves room
+			isFull = false;
 
 			return buf[readloc];
 		}
@@ -211,24 +667,23 @@ public:
 	}
 
 	/*
-	 * Adds a frame at the tail of the deque.
+	 * Adds a frame at the tail of the deque. Returns false (and drops it) if the deque is full.
 	 */
-	void enqueue_tail(const Frame& f) {
-		if (!is_full()) {
-			if (tail == 0) {
-				tail = RX_DEQUE_SIZE;
-			}
-
-			buf[--tail] = f;
+	bool enqueue_tail(const Frame& f) {
+		if (is_full())
+			return false;
 
-			//Check whether full
-			if (head == tail) {
-				isFull = true;
-			}
+		if (tail == 0) {
+			tail = RX_DEQUE_SIZE;
 		}
-		else { // If full, we overwrite the last added message.
-			buf[tail] = f;
+
+		buf[--tail] = f;
+
+		//Check whether full
+		if (head == tail) {
+			isFull = true;
 		}
+		return true;
 	}
 
 	/*
@@ -243,10 +698,8 @@ public:
 				tail = 0;
 			}
 
-			//Check whether queue has been emptied
-			if (tail == head) {
-				isFull = false;
-			}
+			// Removing a frame always leaves room
+			isFull = false;
 
 			return buf[readloc];
 		}
@@ -0,0 +1,108 @@
+/*
+ * TX_Queue.h
+ * Contains definition for the TX_Queue class.
+ */
+
+#ifndef TX_Queue_h
+#define TX_Queue_h
+
+#include <stdint.h>
+#include "MCP2515_defs.h"
+#include "RX_Queue.h"
+
+/*
+ * Static transmit queue for CAN_IO class, kept in bus priority order
+ * (CAN_ArbitrationKey(): lowest ID first). Frames with the same ID keep
+ * the order they were sent in.
+ * The frames never move: a sorted list of slot numbers is shifted instead,
+ * so an insert costs at most Tsize byte moves.
+ * It does not lock: disable interrupts around it if an ISR uses it too.
+ */
+template<int Tsize>
+class TX_Queue : public Frame_Deque {
+	static_assert(Tsize > 0 && Tsize <= 255, "TX_Queue holds up to 255 frames");
+
+	/*Usage:
+		- bool	enqueue_head(Frame)	 -- Adds Frame behind the queued frames of equal or higher priority (false if full)
+		- bool	enqueue_tail(Frame)	 -- Adds Frame ahead of the queued frames with the same ID, for retries (false if full)
+		- Frame dequeue_tail()		 -- Removes the highest priority Frame
+		- Frame dequeue_head()		 -- Removes the lowest priority Frame
+		- Frame* peek()				 -- Returns the highest priority Frame without removing it (0 if empty)
+		- bool	is_full()			 -- Returns true if the queue is full
+		- bool	is_empty()			 -- Returns true if there are no elements in the queue
+		- int	size()				 -- Returns the number of elements in the queue
+		*/
+public:
+	static const int TX_QUEUE_SIZE = Tsize;
+
+	/*
+	 * Constructor. Initializes the queue.
+	 */
+	TX_Queue() : count(0) {
+		for (int i = 0; i < TX_QUEUE_SIZE; i++)
+			order[i] = i; // order[count..] lists the free slots
+	}
+
+	bool is_full() { return count == TX_QUEUE_SIZE; }
+	bool is_empty() { return count == 0; }
+	int size() { return count; }
+
+	bool enqueue_head(const Frame& f) { return insert(f, false); }
+	bool enqueue_tail(const Frame& f) { return insert(f, true); }
+	Frame dequeue_tail() { return remove(0); }
+	Frame dequeue_head() { return remove(count - 1); }
+
+	const Frame* peek() {
+		return count ? &buf[order[0]] : 0;
+	}
+
+private:
+	/*
+	 * Puts f after the frames that win arbitration against it. Frames with the same key go
+	 * before f, or after it if ahead is set.
+	 */
+	bool insert(const Frame& f, bool ahead) {
+		if (count == TX_QUEUE_SIZE)
+			return false;
+
+		uint32_t k = CAN_ArbitrationKey(f);
+		uint8_t lo = 0, hi = count;
+		while (lo < hi) { // Binary search for the insert position
+			uint8_t mid = (lo + hi) / 2;
+			uint32_t km = keys[order[mid]];
+			if (km < k || (!ahead && km == k))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		uint8_t slot = order[count]; // First free slot
+		for (uint8_t i = count; i > lo; i--)
+			order[i] = order[i - 1];
+		order[lo] = slot;
+
+		buf[slot] = f;
+		keys[slot] = k;
+		count++;
+		return true;
+	}
+
+	Frame remove(uint8_t pos) {
+		if (count == 0)
+			return Frame();
+
+		uint8_t slot = order[pos];
+		for (uint8_t i = pos; i + 1 < count; i++)
+			order[i] = order[i + 1];
+		count--;
+		order[count] = slot; // Back on the free list
+		return buf[slot];
+	}
+
+	Frame buf[TX_QUEUE_SIZE];
+	uint32_t keys[TX_QUEUE_SIZE];	// CAN_ArbitrationKey() of each slot
+	uint8_t order[TX_QUEUE_SIZE];	// Slots in priority order, then free slots
+	uint8_t count;
+};
+
+#endif